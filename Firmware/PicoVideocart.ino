@@ -9,21 +9,34 @@
  * 
  * ### Limitations
  * 
- * To save space in both program_attribute and ChipTypes, chip_type is assumed to be an 8-bit value.
+ * To save space in the memory map, chip_type is assumed to be an 8-bit value.
  * This shouldn't be a problem until there are more than 256 chip types defined in the standard.
  */
 
-// TODO: read/write memory according to program_attribute
 // TODO: Disconnecting when loading
 // TODO: Minor menu work (remove ".bin", use .chf title, reload menu when holding reset, etc.) 
 // TODO: Special char support 
-// TODO: set ports according to hardware type
 // TODO: Directories
 // TODO: Double reset issue
 // TODO: Cache(?) issue
 
+#include "benchmark.hpp"
+#include "bus_pio.hpp"
+#include "config.hpp"
+#include "diagnostics.hpp"
+#include "flash_cache.hpp"
+#include "interrupts.hpp"
+#include "latency.hpp"
 #include "loader.hpp"
+#include "mk3870.hpp"
+#include "replay.hpp"
 #include "romc.hpp"
+#include "save_state.hpp"
+#include "sd_benchmark.hpp"
+#include "sd_card.hpp"
+#include "smi.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
 
 #include <SPI.h>
 #include <SD.h>
@@ -43,16 +56,20 @@ void setup1() { // Core 1
     bus_ctrl_hw->priority = BUSCTRL_BUS_PRIORITY_PROC1_BITS;
 
     // Initialize data bus pins
-    gpio_set_dir_in_masked(0xFF << DBUS0_PIN);        // Set DBUS to input mode
-    gpio_clr_mask(0xFF << DBUS0_PIN);                 // Set DBUS data to 0
-    gpio_set_function(DBUS0_PIN + 0, GPIO_FUNC_SIO);  // Set DBUS pins to software controlled
-    gpio_set_function(DBUS0_PIN + 1, GPIO_FUNC_SIO);
-    gpio_set_function(DBUS0_PIN + 2, GPIO_FUNC_SIO);
-    gpio_set_function(DBUS0_PIN + 3, GPIO_FUNC_SIO);
-    gpio_set_function(DBUS0_PIN + 4, GPIO_FUNC_SIO);
-    gpio_set_function(DBUS0_PIN + 5, GPIO_FUNC_SIO);
-    gpio_set_function(DBUS0_PIN + 6, GPIO_FUNC_SIO);
-    gpio_set_function(DBUS0_PIN + 7, GPIO_FUNC_SIO);
+    if constexpr (PIO_BUS_FRONTEND) {
+        bus_pio_init();                               // DBUS and buffer enables are driven by the PIO
+    } else {
+        gpio_set_dir_in_masked(0xFF << DBUS0_PIN);        // Set DBUS to input mode
+        gpio_clr_mask(0xFF << DBUS0_PIN);                 // Set DBUS data to 0
+        gpio_set_function(DBUS0_PIN + 0, GPIO_FUNC_SIO);  // Set DBUS pins to software controlled
+        gpio_set_function(DBUS0_PIN + 1, GPIO_FUNC_SIO);
+        gpio_set_function(DBUS0_PIN + 2, GPIO_FUNC_SIO);
+        gpio_set_function(DBUS0_PIN + 3, GPIO_FUNC_SIO);
+        gpio_set_function(DBUS0_PIN + 4, GPIO_FUNC_SIO);
+        gpio_set_function(DBUS0_PIN + 5, GPIO_FUNC_SIO);
+        gpio_set_function(DBUS0_PIN + 6, GPIO_FUNC_SIO);
+        gpio_set_function(DBUS0_PIN + 7, GPIO_FUNC_SIO);
+    }
     
     // Initialize ROMC pins
     gpio_set_dir_in_masked(0x1F << ROMC0_PIN);        // Set ROMC to input mode
@@ -66,20 +83,61 @@ void setup1() { // Core 1
     // Initialize other cartridge pins
     gpio_init_val(WRITE_PIN, GPIO_IN, false);
     gpio_init_val(PHI_PIN, GPIO_IN, false);
-    gpio_init_val(DBUS_OUT_CE_PIN, GPIO_OUT, true);
-    gpio_init_val(DBUS_IN_CE_PIN, GPIO_OUT, false);
+    if constexpr (!PIO_BUS_FRONTEND) {
+        gpio_init_val(DBUS_OUT_CE_PIN, GPIO_OUT, true);
+        gpio_init_val(DBUS_IN_CE_PIN, GPIO_OUT, false);
+    }
     gpio_init_val(LED_BUILTIN, GPIO_OUT, true);
 
-   // Shift into maximum overdrive (aka 400 MHz @ 1.3 V)
-    vreg_set_voltage(VREG_VOLTAGE_1_30);
+   // Shift into maximum overdrive (aka 400 MHz @ 1.3 V), unless the PIO is serving the bus
+    startup_begin(STARTUP::CLOCK);
+    vreg_set_voltage(CORE_VOLTAGE);
     sleep_ms(1);
-    if (!set_sys_clock_khz(400000, false)) { // 428000 is known to work on some devices
+    if (!set_sys_clock_khz(SYS_CLOCK_KHZ, false)) {
         blink_code(BLINK::OVERCLOCK_FAILED);
         panic("Overclock was unsuccessful");
     }
+    startup_end(STARTUP::CLOCK);
+
+    if constexpr (BUS_LATENCY) {
+        cycle_counter_init();
+    }
 }
 
 void __not_in_flash_func(loop1)() { // Core 1
+    if constexpr (ROMC_BENCHMARK) {
+        run_romc_benchmark();
+        for (;;) {
+            tight_loop_contents();
+        }
+    }
+    if constexpr (TRACE_REPLAY) {
+        run_trace_replay();
+        for (;;) {
+            tight_loop_contents();
+        }
+    }
+
+    if constexpr (PIO_BUS_FRONTEND) {
+        for (;;) {
+            if constexpr (SPECULATIVE_FETCH) {
+                prefetch_romc();
+            }
+            bus_pio_read_cycle();  // Rising edge
+            uint32_t edge = BUS_LATENCY ? latency_start() : 0;
+            TraceRecord snapshot = BUS_TRACE ? trace_snapshot() : TraceRecord{};
+            execute_romc();
+            bus_pio_respond();
+            if constexpr (BUS_LATENCY) {
+                latency_record(edge);
+            }
+            if constexpr (BUS_TRACE) {
+                trace_cycle(snapshot);  // After the response, out of the edge-to-drive window
+            }
+            menu_exit_check(pc0);
+        }
+    }
+
     for (;;) {
         while(gpio_get(WRITE_PIN)==1) {
             tight_loop_contents();
@@ -88,18 +146,46 @@ void __not_in_flash_func(loop1)() { // Core 1
         gpio_put(DBUS_OUT_CE_PIN, true);            // Disable output buffer
         gpio_set_dir_in_masked(0xFF << DBUS0_PIN);  // Set DBUS to input mode
         gpio_put(DBUS_IN_CE_PIN, false);            // Enable input buffer
+        if constexpr (SPECULATIVE_FETCH) {
+            prefetch_romc();
+        }
             
         while(gpio_get(WRITE_PIN)==0) {
             tight_loop_contents();
         } 
         // Rising edge
+        uint32_t edge = BUS_LATENCY ? latency_start() : 0;
         dbus = read_dbus();
         romc = read_romc();
+        TraceRecord snapshot = BUS_TRACE ? trace_snapshot() : TraceRecord{};
         execute_romc();
+        if constexpr (BUS_LATENCY) {
+            latency_record(edge);
+        }
+        if constexpr (BUS_TRACE) {
+            trace_cycle(snapshot);  // The data bus is driven by now
+        }
+        menu_exit_check(pc0);
+    }
+}
+
+/*! \brief Wait for the CPU to jump into the Videocart, and note the time since power on */
+void record_first_fetch() {
+    absolute_time_t timeout = make_timeout_time_ms(3000);
+    while (__atomic_load_n(&pc0, __ATOMIC_RELAXED) < VIDEOCART_START_ADDR && !time_reached(timeout)) {
+        tight_loop_contents();
     }
+    flash_cache_stats.first_fetch_us = time_reached(timeout) ? 0 : time_us_32();
 }
 
 void __not_in_flash_func(setup)() { // Core 0
+    if constexpr (ROMC_BENCHMARK) {
+        Serial.begin(115200);
+        return;
+    }
+    if constexpr (SERIAL_DIAGNOSTICS || SD_BENCHMARK || (BUS_TRACE && TRACE_TO_SERIAL)) {
+        Serial.begin(115200);
+    }
 
     // Setup SD card pins
     SPI.setSCK(SERIAL_CLOCK_PIN);
@@ -107,39 +193,113 @@ void __not_in_flash_func(setup)() { // Core 0
     SPI.setRX(RECEIVE_PIN);
     SPI.setCS(SD_CARD_CHIP_SELECT_PIN);
     gpio_init_val(WRITE_PROTECT_PIN, GPIO_IN, false);
+
+    // Setup interrupts, handled on this core
+    static bool interrupts_ready = false; // setup() runs again when an SD card is inserted
+    if (!interrupts_ready) {
+        interrupts_init();
+        smi_init();
+        mk3870_init();
+        interrupts_ready = true;
+    }
     gpio_pull_up(WRITE_PROTECT_PIN);
     gpio_init_val(FRAM_CHIP_SELECT_PIN, GPIO_OUT, true);
 
-    // Load the game
-    //FIXME: SD.begin(SD_CARD_CHIP_SELECT_PIN, SD_SCK_MHZ(50))
-    // fall back to 25, then 4 if it doesn't work (but only if there's an SD inserted)
-    while (!SD.begin(SD_CARD_CHIP_SELECT_PIN)) { // wait for SD card
-        sleep_ms(250);
+    // Start the menu from flash if it's cached, otherwise from the SD card
+    startup_begin(STARTUP::ROM_LOAD);
+    int8_t boot_slot = flash_cache_find(BOOT_NAME);
+    flash_cache_stats.boot_from_cache = boot_slot >= 0 && flash_cache_load(boot_slot);
+    if (flash_cache_stats.boot_from_cache) {
+        startup_end(STARTUP::ROM_LOAD);
     }
-    File romFile = SD.open("boot.bin");
-    load_game(romFile);
-
-    uint16_t file_counter = 0;
-    File dir = SD.open("/");
-    File current_file = dir.openNextFile();
-    while (current_file) {
-        if (current_file.isDirectory()) {
-            file_data[file_counter].title[0] = '/';
-        } else {
-            file_data[file_counter].title[0] = ' ';
+    flash_cache_stats.boot_ready_us = time_us_32();
+    if constexpr (SERIAL_DIAGNOSTICS) {
+        if (flash_cache_stats.boot_from_cache) {
+            record_first_fetch();
         }
-        file_data[file_counter].isFile = !current_file.isDirectory();
-        string_copy((char*) file_data[file_counter].title + 1, (char*)current_file.name(), 30, true, '\0');
-        file_counter++;
-        current_file = dir.openNextFile();
     }
-    DIR_LIMIT = file_counter;
+
+    // Load the game
+    startup_begin(STARTUP::SD_INIT);
+    sd_begin();
+    startup_end(STARTUP::SD_INIT);
+    if (!flash_cache_stats.boot_from_cache) {
+        startup_begin(STARTUP::ROM_LOAD);
+        File romFile = SD.open("boot.bin");
+        load_game(romFile);
+        startup_end(STARTUP::ROM_LOAD);
+        flash_cache_stats.boot_ready_us = time_us_32();
+        if constexpr (SERIAL_DIAGNOSTICS) {
+            record_first_fetch();
+        }
+    }
+    menu_running = true;
+    sd_remember_speed();
+
+    startup_begin(STARTUP::DIRECTORY);
+    directory_open();
+    startup_end(STARTUP::DIRECTORY);
+    flash_cache_sync_begin();
 };
 
 void __not_in_flash_func(loop)() { // Core 0
+    if constexpr (ROMC_BENCHMARK) {
+        static bool reported = false;
+        if (benchmark_done && !reported) {
+            print_romc_benchmark(Serial);
+            reported = true;
+        }
+        sleep_ms(250);
+        return;
+    }
+
+    if constexpr (TRACE_REPLAY) {
+        static bool reported = false;
+        if (!replay_loaded) {
+            replay_feed();
+        } else if (replay_done && !reported) {
+            print_replay(Serial);
+            reported = true;
+        }
+        return;
+    }
+
+    if constexpr (SD_BENCHMARK) {
+        static bool reported = false;
+        if (!reported) {
+            run_sd_benchmark();
+            print_sd_benchmark(Serial);
+            reported = true;
+        }
+        sleep_ms(250);
+        return;
+    }
+
+    if constexpr (SERIAL_DIAGNOSTICS) {
+        static uint32_t last_report = 0;
+        if (millis() - last_report >= DIAGNOSTICS_PERIOD_MS) {
+            print_diagnostics(Serial);
+            last_report = millis();
+        }
+    }
+
+    // Sleep until core 1 needs something, or it's time to check the SD card
+    // (but not while the directory index or the flash cache is being checked,
+    // or while tracing)
+    bool busy = directory_verify_step();
+    busy |= flash_cache_step();
+    if constexpr (BUS_TRACE) {
+        trace_drain();
+        busy = true;
+    }
+    wait_for_message(busy ? 0 : 250);
+    nvram_flush();
+    if constexpr (SAVE_STATES) {
+        save_step();
+    }
+
     // Re-run setup if SD card inserted
     // FIXME: make a SD_DETECT function in gpio.hpp
-    sleep_ms(250);
     if (gpio_get(WRITE_PROTECT_PIN) != old_write_protect) {
         if (old_write_protect) {
             sleep_ms(250);
@@ -151,20 +311,60 @@ void __not_in_flash_func(loop)() { // Core 0
         old_write_protect = gpio_get(WRITE_PROTECT_PIN);
     }
 
-    if (load_new_game_trigger) {
-        load_new_game_trigger = false;
-        while (pc0 >= 0x800) {
-            ; // We need to wait until the menu has jumped to 0 before disconnecting
-        }
+    Message message;
+    while (core1_to_core0.pop(message)) {
+        switch (message.type) {
+            case MESSAGE::LOAD_GAME: {
+                uint32_t selected_ms = millis();
+                menu_running = false; // No more flash writes
+                post_to_core1({MESSAGE::LOAD_STARTED, message.argument});
+                if (!wait_for_menu_exit()) { // The menu must have jumped to 0 before its memory is replaced
+                    post_to_core1({MESSAGE::LOAD_DONE, LOAD_STATUS::MENU_STAYED});
+                    menu_running = true;
+                    break;
+                }
 
-        // Get file from index
-        File romFile;
-        File dir = SD.open("/");
-        dir.rewindDirectory();
-        uint16_t file_index = static_cast<Launcher*>(IOPorts[0xFF])->file_index;
-        for (uint32_t i = 0; i <= file_index; i++) {
-            romFile = dir.openNextFile();
+                uint32_t open_start_us = time_us_32();
+                File romFile = directory_open_file(message.argument);
+                directory_stats.last_open_us = time_us_32() - open_start_us;
+                bool found = romFile;
+                char name[FLASH_CACHE_NAME_SIZE] = {0};
+                int8_t slot = -1;
+                if (found) {
+                    strncpy(name, romFile.name(), sizeof(name) - 1);
+                    slot = flash_cache_find(romFile);
+                }
+                bool valid;
+                if (slot >= 0) {
+                    valid = flash_cache_load(slot);
+                    flash_cache_verify_begin(romFile, slot); // Check the cached copy once the game is running
+                    flash_cache_stats.hits++;
+                } else {
+                    valid = load_game(romFile);
+                    flash_cache_stats.misses += found;
+                }
+                if constexpr (SAVE_STATES) {
+                    if (found && valid) {
+                        save_begin(name); // Restored before the game starts
+                    }
+                }
+                post_to_core1({MESSAGE::LOAD_DONE, !found ? LOAD_STATUS::NOT_FOUND : valid ? LOAD_STATUS::OK : LOAD_STATUS::INVALID});
+                directory_stats.last_index = message.argument;
+                directory_stats.last_select_ms = millis() - selected_ms;
+                if (found) {
+                    flash_cache_add_recent(name);
+                }
+                break;
+            }
+            case MESSAGE::FILL_WINDOW:
+                directory_fill_window(message.argument);
+                break;
+            case MESSAGE::FILL_PAGE:
+                title_page_fill(message.argument);
+                break;
+            case MESSAGE::FIND_LETTER:
+                post_to_core1({MESSAGE::LETTER_FOUND, directory_find_letter(message.argument)});
+                break;
         }
-        load_game(romFile);
     }
 };
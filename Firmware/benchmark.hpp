@@ -0,0 +1,384 @@
+/** \file benchmark.hpp
+ *
+ * \brief Per-opcode latency benchmark for execute_romc()
+ *
+ * \details Feeds synthetic (romc, dbus) streams through execute_romc() on core 1
+ * and times every call with the SysTick counter. For each ROMC code the best,
+ * worst and mean latency is recorded. A mixed stream, modelled on a typical
+ * instruction mix, gives the throughput of the bus path as a whole. Every ROMC
+ * code is timed both with and without the speculative prefetch, from the same
+ * register state, so the two can be compared directly. Bank switches are timed
+ * through OUTS to the BankSelect port, as a game would do them, and compared
+ * with the length of a bus cycle. The cost of recording a cycle with
+ * trace_snapshot() and trace_cycle() (see trace.hpp) is timed over the mixed
+ * stream as well.
+ *
+ * Port reads and writes through the port table are timed against the virtual
+ * dispatch it replaced, which is kept here (VirtualPort) only for comparison.
+ * Likewise, driving the data bus from romc_actions (drive_romc()) is timed for
+ * each ROMC code against the switch and address range check it replaced
+ * (switch_drive_romc()).
+ *
+ * Enable it with ROMC_BENCHMARK in config.hpp. Core 1 runs the benchmark in
+ * place of the bus loop, and core 0 prints the report over USB serial. Because
+ * write_dbus() still drives the data bus pins, the Pico must not be plugged into
+ * a console while the benchmark runs.
+ */
+
+#pragma once
+
+#include "config.hpp"
+#include "romc.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
+
+inline constexpr uint32_t BENCHMARK_ITERATIONS = 4096; // Calls timed per ROMC code
+inline constexpr uint32_t BENCHMARK_PASSES = 256;      // Passes over the mixed stream
+inline constexpr uint8_t BENCHMARK_PORT = 0x20;        // Port used by ROMC 0x1A/0x1B
+inline constexpr uint32_t BUS_CYCLE_NS = 2235;         // Short bus cycle, 4 periods of the 1.79 MHz PHI
+
+struct RomcTiming {
+    uint32_t min = UINT32_MAX;
+    uint32_t max = 0;
+    uint64_t total = 0;
+    uint32_t count = 0;
+
+    __force_inline void record(uint32_t cycles) {
+        min = cycles < min ? cycles : min;
+        max = cycles > max ? cycles : max;
+        total += cycles;
+        count++;
+    }
+};
+
+inline RomcTiming romc_timing[32];      // Latency of each ROMC code
+inline RomcTiming romc_timing_prefetched[32]; // Latency of each ROMC code after prefetch_romc()
+inline RomcTiming mixed_timing;         // Latency of each cycle in the mixed stream
+inline RomcTiming bank_switch_timing;   // Latency of ROMC 0x1A writing to BankSelect
+inline RomcTiming trace_timing;         // Latency of trace_snapshot() and trace_cycle() recording a cycle
+inline RomcTiming port_timing[2];       // Port write and read through the port table
+inline RomcTiming virtual_port_timing[2]; // Port write and read through a virtual call, as before the port table
+inline RomcTiming drive_timing[32];     // Driving the bus through romc_actions
+inline RomcTiming switch_drive_timing[32]; // Driving the bus through a switch, as before romc_actions
+inline uint32_t mixed_stream_cycles;    // Total cycles spent on the mixed stream
+inline uint32_t timing_overhead;        // Cycles spent reading the counter, subtracted from every sample
+inline volatile bool benchmark_done = false;
+
+/*! \brief (romc, dbus) pairs approximating a typical instruction mix
+ *
+ * \details LI, LM, ST, OUTS, INS, BR, PI, DCI, XDC and POP, as they appear on
+ * the bus. Jump targets are kept within the Videocart address space.
+ */
+inline constexpr uint8_t MIXED_STREAM[][2] = {
+    {0x00, 0x20}, {0x03, 0x00},                             // LI
+    {0x00, 0x16}, {0x02, 0x00},                             // LM
+    {0x00, 0x17}, {0x05, 0x5A},                             // ST
+    {0x00, 0xB0}, {0x1C, BENCHMARK_PORT}, {0x1A, 0x03},     // OUTS
+    {0x00, 0xA0}, {0x1C, BENCHMARK_PORT}, {0x1B, 0x00},     // INS
+    {0x00, 0x90}, {0x1C, 0x00}, {0x01, 0x04},               // BR
+    {0x00, 0x28}, {0x03, 0x00}, {0x0D, 0x00},               // PI
+    {0x14, 0x09}, {0x03, 0x00}, {0x17, 0x40},
+    {0x00, 0x2A}, {0x11, 0x00}, {0x03, 0x00}, {0x0E, 0x00}, // DCI
+    {0x00, 0x2C}, {0x1D, 0x00},                             // XDC
+    {0x00, 0x1C}, {0x04, 0x00},                             // POP
+};
+
+/*! \brief The virtual port interface the port table replaced */
+class VirtualPort {
+    public:
+        virtual uint8_t read() = 0;
+        virtual void write(uint8_t) = 0;
+};
+
+class VirtualSram2102 : public VirtualPort {
+    private:
+        uint8_t port;
+
+    public:
+        VirtualSram2102(uint8_t port): port(port) {}
+        uint8_t read() {return Sram2102::read(port);}
+        void write(uint8_t data) {Sram2102::write(port, data);}
+};
+
+inline VirtualPort* virtual_ports[256];
+inline volatile bool virtual_ports_suspended = false;
+
+/*! \brief Put a value on the data bus if the address is in the range romc_actions replaced
+ *
+ * \param value The byte to write
+ * \param addr_source The address being targeted
+ */
+__force_inline void range_check_dbus(uint8_t value, uint16_t addr_source) {
+    if (addr_source >= VIDEOCART_START_ADDR && addr_source < (VIDEOCART_START_ADDR + VIDEOCART_SIZE)) {
+        drive_dbus(value);
+    }
+}
+
+/*! \brief Drive the data bus for the current ROMC code, as execute_romc() did before romc_actions */
+__force_inline void switch_drive_romc() {
+    switch (romc) {
+        case 0x00:
+        case 0x01:
+        case 0x03:
+        case 0x0C:
+        case 0x0E:
+        case 0x11:
+            range_check_dbus(read_program_byte(pc0), pc0);
+            break;
+        case 0x02:
+            range_check_dbus(read_program_byte(dc0), dc0);
+            break;
+        case 0x06:
+            range_check_dbus(dc0 >> 8, dc0);
+            break;
+        case 0x07:
+            range_check_dbus(pc1 >> 8, pc1);
+            break;
+        case 0x09:
+            range_check_dbus(dc0 & 0xff, dc0);
+            break;
+        case 0x0B:
+            range_check_dbus(pc1 & 0xff, pc1);
+            break;
+        case 0x1E:
+            range_check_dbus(pc0 & 0xff, pc0);
+            break;
+        case 0x1F:
+            range_check_dbus((pc0 >> 8) & 0xff, pc0);
+            break;
+    }
+}
+
+/*! \brief Linear congruential generator, so every run sees the same stream */
+__force_inline uint32_t benchmark_random() {
+    static uint32_t seed = 0x2F6E2B1;
+    seed = seed * 1664525 + 1013904223;
+    return seed;
+}
+
+/*! \brief Put the ROMC registers somewhere inside the Videocart address space */
+__force_inline void benchmark_reset_registers() {
+    pc0 = VIDEOCART_START_ADDR + benchmark_random() % VIDEOCART_SIZE;
+    pc1 = VIDEOCART_START_ADDR + benchmark_random() % VIDEOCART_SIZE;
+    dc0 = VIDEOCART_START_ADDR + benchmark_random() % VIDEOCART_SIZE;
+    dc1 = VIDEOCART_START_ADDR + benchmark_random() % VIDEOCART_SIZE;
+    io_address = BENCHMARK_PORT;
+}
+
+/*! \brief Time a single call of execute_romc()
+ *
+ * \tparam speculative Call prefetch_romc() (untimed) first and drive from its results
+ */
+template <bool speculative = SPECULATIVE_FETCH>
+__force_inline uint32_t benchmark_execute() {
+    if constexpr (speculative) {
+        prefetch_romc();
+    }
+    __compiler_memory_barrier();
+    uint32_t start = cycle_count();
+    __compiler_memory_barrier();
+    execute_romc<speculative>();
+    __compiler_memory_barrier();
+    uint32_t end = cycle_count();
+    __compiler_memory_barrier();
+    uint32_t cycles = cycles_elapsed(start, end);
+    return cycles > timing_overhead ? cycles - timing_overhead : 0;
+}
+
+/*! \brief Run the benchmark. Must be called from core 1 */
+void __not_in_flash_func(run_romc_benchmark)() {
+    cycle_counter_init();
+    port_attach<Sram2102>(BENCHMARK_PORT);
+
+    // Measure the cost of reading the counter
+    timing_overhead = UINT32_MAX;
+    for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+        __compiler_memory_barrier();
+        uint32_t start = cycle_count();
+        __compiler_memory_barrier();
+        uint32_t end = cycle_count();
+        __compiler_memory_barrier();
+        uint32_t cycles = cycles_elapsed(start, end);
+        timing_overhead = cycles < timing_overhead ? cycles : timing_overhead;
+    }
+
+    // Each ROMC code on its own
+    for (uint8_t code = 0; code < 32; code++) {
+        for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+            benchmark_reset_registers();
+            uint16_t registers[] = {pc0, pc1, dc0, dc1};
+            romc = code;
+            dbus = benchmark_random();
+            uint8_t bus = dbus;
+            romc_timing[code].record(benchmark_execute<false>());
+
+            // Same again with prefetching
+            pc0 = registers[0], pc1 = registers[1], dc0 = registers[2], dc1 = registers[3];
+            io_address = BENCHMARK_PORT;
+            dbus = bus;
+            romc_timing_prefetched[code].record(benchmark_execute<true>());
+        }
+    }
+
+    // Driving the bus on its own, romc_actions against the switch. Neither
+    // changes the registers, so both see the same state
+    for (uint8_t code = 0; code < 32; code++) {
+        romc = code;
+        for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+            benchmark_reset_registers();
+            __compiler_memory_barrier();
+            uint32_t start = cycle_count();
+            __compiler_memory_barrier();
+            drive_romc<false>();
+            __compiler_memory_barrier();
+            uint32_t middle = cycle_count();
+            __compiler_memory_barrier();
+            switch_drive_romc();
+            __compiler_memory_barrier();
+            uint32_t end = cycle_count();
+            __compiler_memory_barrier();
+            uint32_t table = cycles_elapsed(start, middle);
+            uint32_t switch_drive = cycles_elapsed(middle, end);
+            drive_timing[code].record(table > timing_overhead ? table - timing_overhead : 0);
+            switch_drive_timing[code].record(switch_drive > timing_overhead ? switch_drive - timing_overhead : 0);
+        }
+    }
+
+    // Mixed stream
+    mixed_stream_cycles = 0;
+    for (uint32_t pass = 0; pass < BENCHMARK_PASSES; pass++) {
+        benchmark_reset_registers();
+        for (auto &cycle : MIXED_STREAM) {
+            romc = cycle[0];
+            dbus = cycle[1];
+            uint32_t cycles = benchmark_execute();
+            mixed_timing.record(cycles);
+            mixed_stream_cycles += cycles;
+        }
+    }
+
+    // Bank switching, with every bank loaded
+    port_attach<BankSelect>(BANK_SELECT_PORT);
+    for (uint8_t bank = 1; bank < BANK_LIMIT; bank++) {
+        bank_page(bank, VIDEOCART_START_ADDR >> 8);
+    }
+    for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+        benchmark_reset_registers();
+        io_address = BANK_SELECT_PORT;
+        romc = 0x1A;
+        dbus = benchmark_random() % BANK_LIMIT;
+        bank_switch_timing.record(benchmark_execute());
+    }
+    bank_reset();
+
+    // Port dispatch, the port table against a virtual call. Each is timed on its
+    // own, without the rest of execute_romc()
+    static VirtualSram2102 virtual_sram(BENCHMARK_PORT);
+    virtual_ports[BENCHMARK_PORT] = &virtual_sram;
+    for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+        io_address = BENCHMARK_PORT;
+        dbus = benchmark_random();
+        for (uint8_t read = 0; read < 2; read++) {
+            __compiler_memory_barrier();
+            uint32_t start = cycle_count();
+            __compiler_memory_barrier();
+            if (read) {
+                port_dispatch_read(io_address);
+            } else {
+                port_dispatch_write(io_address, dbus);
+            }
+            __compiler_memory_barrier();
+            uint32_t middle = cycle_count();
+            __compiler_memory_barrier();
+            if (virtual_ports[io_address] != nullptr && !virtual_ports_suspended) {
+                if (read) {
+                    drive_dbus(virtual_ports[io_address]->read());
+                } else {
+                    virtual_ports[io_address]->write(dbus);
+                }
+            }
+            __compiler_memory_barrier();
+            uint32_t end = cycle_count();
+            __compiler_memory_barrier();
+            uint32_t table = cycles_elapsed(start, middle);
+            uint32_t virtual_call = cycles_elapsed(middle, end);
+            port_timing[read].record(table > timing_overhead ? table - timing_overhead : 0);
+            virtual_port_timing[read].record(virtual_call > timing_overhead ? virtual_call - timing_overhead : 0);
+        }
+    }
+    virtual_ports[BENCHMARK_PORT] = nullptr;
+
+    // Tracing every cycle. Core 0 doesn't drain the ring while the benchmark runs,
+    // so it is emptied here, untimed
+    TraceTrigger trigger = trace_trigger;
+    trace_trigger = {0xFFFFFFFF, 0, -1, 0, 0};
+    for (uint32_t pass = 0; pass < BENCHMARK_PASSES; pass++) {
+        benchmark_reset_registers();
+        for (auto &cycle : MIXED_STREAM) {
+            romc = cycle[0];
+            dbus = cycle[1];
+            __compiler_memory_barrier();
+            uint32_t start = cycle_count();
+            __compiler_memory_barrier();
+            trace_cycle(trace_snapshot());
+            __compiler_memory_barrier();
+            uint32_t end = cycle_count();
+            __compiler_memory_barrier();
+            uint32_t cycles = cycles_elapsed(start, end);
+            trace_timing.record(cycles > timing_overhead ? cycles - timing_overhead : 0);
+            TraceRecord record;
+            bus_trace.pop(record);
+        }
+    }
+    trace_trigger = trigger;
+
+    // Leave the bus the way loop1() would on a falling edge
+    gpio_put(DBUS_OUT_CE_PIN, true);
+    gpio_set_dir_in_masked(0xFF << DBUS0_PIN);
+    gpio_put(DBUS_IN_CE_PIN, false);
+    benchmark_done = true;
+}
+
+/*! \brief Print the benchmark results
+ *
+ * \param out Where to print the report (e.g. Serial)
+ */
+void print_romc_benchmark(Print &out) {
+    out.printf("ROMC benchmark @ %lu MHz, counter overhead %lu cycles\n", clock_get_hz(clk_sys) / 1000000, timing_overhead);
+    out.printf("ROMC | min ns | mean ns | max ns | prefetched min ns | mean ns | max ns\n");
+    for (uint8_t code = 0; code < 32; code++) {
+        RomcTiming &t = romc_timing[code];
+        RomcTiming &p = romc_timing_prefetched[code];
+        out.printf("0x%02X | %6lu | %7lu | %6lu | %17lu | %7lu | %6lu\n", code,
+                   cycles_to_ns(t.min), cycles_to_ns(t.total / t.count), cycles_to_ns(t.max),
+                   cycles_to_ns(p.min), cycles_to_ns(p.total / p.count), cycles_to_ns(p.max));
+    }
+
+    uint32_t worst = 0;
+    for (auto &t : (SPECULATIVE_FETCH ? romc_timing_prefetched : romc_timing)) {
+        worst = t.max > worst ? t.max : worst;
+    }
+    uint32_t stream_ns = cycles_to_ns(mixed_stream_cycles);
+    out.printf("Worst case: %lu ns\n", cycles_to_ns(worst));
+    out.printf("Bank switch: min %lu ns, mean %lu ns, max %lu ns (bus cycle %lu ns)\n", cycles_to_ns(bank_switch_timing.min),
+               cycles_to_ns(bank_switch_timing.total / bank_switch_timing.count), cycles_to_ns(bank_switch_timing.max), BUS_CYCLE_NS);
+    for (uint8_t code = 0; code < 32; code++) {
+        if (romc_actions[code].drive != DRIVE::NONE) {
+            RomcTiming &t = drive_timing[code];
+            RomcTiming &s = switch_drive_timing[code];
+            out.printf("Drive 0x%02X: table mean %lu ns (max %lu ns), switch mean %lu ns (max %lu ns)\n", code,
+                       cycles_to_ns(t.total / t.count), cycles_to_ns(t.max), cycles_to_ns(s.total / s.count), cycles_to_ns(s.max));
+        }
+    }
+    const char* access_names[] = {"write", "read"};
+    for (uint8_t read = 0; read < 2; read++) {
+        RomcTiming &t = port_timing[read];
+        RomcTiming &v = virtual_port_timing[read];
+        out.printf("Port %s: table mean %lu ns (max %lu ns), virtual mean %lu ns (max %lu ns)\n", access_names[read],
+                   cycles_to_ns(t.total / t.count), cycles_to_ns(t.max), cycles_to_ns(v.total / v.count), cycles_to_ns(v.max));
+    }
+    out.printf("Trace: min %lu ns, mean %lu ns, max %lu ns per cycle recorded\n", cycles_to_ns(trace_timing.min),
+               cycles_to_ns(trace_timing.total / trace_timing.count), cycles_to_ns(trace_timing.max));
+    out.printf("Mixed stream: mean %lu ns, max %lu ns, %lu bus cycles/ms\n", cycles_to_ns(mixed_timing.total / mixed_timing.count),
+               cycles_to_ns(mixed_timing.max), stream_ns ? (uint32_t) (mixed_timing.count * 1000000ull / stream_ns) : 0);
+}
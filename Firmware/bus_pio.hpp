@@ -0,0 +1,131 @@
+/** \file bus_pio.hpp
+ *
+ * \brief PIO front end for the cartridge bus
+ *
+ * \details Moves edge detection, buffer enables and bus direction from core 1
+ * into a PIO state machine. On every cycle the state machine:
+ *
+ * 1. Waits for WRITE to fall, then releases the data bus: output buffer off,
+ *    DBUS pins to input, input buffer on (the same order as loop1() uses)
+ * 2. Waits for WRITE to rise, then samples DBUS and ROMC into the RX FIFO
+ * 3. Waits for core 1 to push a response into the TX FIFO
+ * 4. If the response has BUS_RESPONSE_DRIVE set, puts the low byte on DBUS:
+ *    input buffer off, DBUS pins to output, output buffer on
+ *
+ * Core 1 only pulls a sample, runs execute_romc() and pushes the response, so
+ * its timing no longer decides when the buffers switch, and WRITE is never
+ * polled in software.
+ *
+ * The sample is 17 bits wide, taken from DBUS0_PIN upwards:
+ *
+ *  Bits    | Pins       | Signal
+ *  --------|------------|-------
+ *  0 - 7   | GP6 - 13   | DBUS0 - DBUS7
+ *  8 - 9   | GP14 - 15  | DBUS_OUT_CE, DBUS_IN_CE
+ *  10      | GP16       | INTRQ
+ *  11      | GP17       | WRITE
+ *  12 - 16 | GP18 - 22  | ROMC0 - ROMC4
+ *
+ * ### Program
+ *
+ * ```
+ * .side_set 2 opt                       ; DBUS_OUT_CE, DBUS_IN_CE
+ * .wrap_target
+ *     wait 0 gpio WRITE                 ; Falling edge
+ *     mov osr, null        side 0b11    ; Disable output buffer
+ *     out pindirs, 8                    ; Set DBUS to input mode
+ *     nop                  side 0b01    ; Enable input buffer
+ *     wait 1 gpio WRITE                 ; Rising edge
+ *     in pins, 17                       ; Sample DBUS and ROMC (autopush)
+ *     pull block                        ; Wait for the response from core 1
+ *     out pins, 8                       ; Response byte
+ *     out x, 1                          ; Drive flag
+ *     jmp !x, 0                         ; Not our address, leave the bus alone
+ *     mov osr, ~null       side 0b11    ; Disable input buffer
+ *     out pindirs, 8                    ; Set DBUS to output mode
+ *     nop                  side 0b10    ; Enable output buffer
+ * .wrap
+ * ```
+ */
+
+#pragma once
+
+#include "romc.hpp"
+
+#include <hardware/pio.h>
+#include <hardware/pio_instructions.h>
+
+inline PIO const BUS_PIO = pio0;
+inline uint bus_sm;
+
+inline constexpr uint8_t BUS_SAMPLE_BITS = 17;
+inline constexpr uint8_t BUS_SAMPLE_ROMC_SHIFT = ROMC0_PIN - DBUS0_PIN;
+
+namespace BUS_SIDE {  // Side-set values, bit 0 is DBUS_OUT_CE_PIN and bit 1 is DBUS_IN_CE_PIN (both active low)
+    inline constexpr uint8_t INPUT = 0b01;     // Input buffer enabled
+    inline constexpr uint8_t RELEASED = 0b11;  // Both buffers disabled
+    inline constexpr uint8_t OUTPUT = 0b10;    // Output buffer enabled
+}
+
+static_assert(DBUS_IN_CE_PIN == DBUS_OUT_CE_PIN + 1, "Buffer enables must be consecutive for side-set");
+
+/*! \brief Load the bus program and start it. Must be called from core 1 */
+void bus_pio_init() {
+    constexpr uint8_t SIDE_BITS = 2;
+    uint16_t instructions[] = {
+        (uint16_t) pio_encode_wait_gpio(false, WRITE_PIN),
+        (uint16_t) (pio_encode_mov(pio_osr, pio_null) | pio_encode_sideset_opt(SIDE_BITS, BUS_SIDE::RELEASED)),
+        (uint16_t) pio_encode_out(pio_pindirs, 8),
+        (uint16_t) (pio_encode_nop() | pio_encode_sideset_opt(SIDE_BITS, BUS_SIDE::INPUT)),
+        (uint16_t) pio_encode_wait_gpio(true, WRITE_PIN),
+        (uint16_t) pio_encode_in(pio_pins, BUS_SAMPLE_BITS),
+        (uint16_t) pio_encode_pull(false, true),
+        (uint16_t) pio_encode_out(pio_pins, 8),
+        (uint16_t) pio_encode_out(pio_x, 1),
+        (uint16_t) pio_encode_jmp_not_x(0),
+        (uint16_t) (pio_encode_mov_not(pio_osr, pio_null) | pio_encode_sideset_opt(SIDE_BITS, BUS_SIDE::RELEASED)),
+        (uint16_t) pio_encode_out(pio_pindirs, 8),
+        (uint16_t) (pio_encode_nop() | pio_encode_sideset_opt(SIDE_BITS, BUS_SIDE::OUTPUT)),
+    };
+    const pio_program_t program = {instructions, sizeof(instructions) / sizeof(instructions[0]), -1};
+
+    bus_sm = pio_claim_unused_sm(BUS_PIO, true);
+    uint offset = pio_add_program(BUS_PIO, &program); // Relocates the jmp
+
+    // Hand the data bus and buffer enables to the PIO
+    for (uint8_t pin = DBUS0_PIN; pin < DBUS0_PIN + 8; pin++) {
+        pio_gpio_init(BUS_PIO, pin);
+    }
+    pio_gpio_init(BUS_PIO, DBUS_OUT_CE_PIN);
+    pio_gpio_init(BUS_PIO, DBUS_IN_CE_PIN);
+    pio_sm_set_pins_with_mask(BUS_PIO, bus_sm, (1u << DBUS_OUT_CE_PIN), (0xFFu << DBUS0_PIN) | (3u << DBUS_OUT_CE_PIN));
+    pio_sm_set_pindirs_with_mask(BUS_PIO, bus_sm, (3u << DBUS_OUT_CE_PIN), (0xFFu << DBUS0_PIN) | (3u << DBUS_OUT_CE_PIN));
+
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset, offset + program.length - 1);
+    sm_config_set_sideset(&c, SIDE_BITS + 1, true, false);
+    sm_config_set_sideset_pins(&c, DBUS_OUT_CE_PIN);
+    sm_config_set_in_pins(&c, DBUS0_PIN);
+    sm_config_set_out_pins(&c, DBUS0_PIN, 8);
+    sm_config_set_in_shift(&c, false, true, BUS_SAMPLE_BITS);  // Shift left, autopush
+    sm_config_set_out_shift(&c, true, false, 32);              // Shift right, no autopull
+    sm_config_set_clkdiv_int_frac(&c, 1, 0);
+    pio_sm_init(BUS_PIO, bus_sm, offset, &c);
+    pio_sm_set_enabled(BUS_PIO, bus_sm, true);
+}
+
+/*! \brief Wait for the next rising edge of WRITE and load dbus and romc */
+__force_inline void bus_pio_read_cycle() {
+    while (pio_sm_is_rx_fifo_empty(BUS_PIO, bus_sm)) {
+        tight_loop_contents();
+    }
+    uint32_t sample = BUS_PIO->rxf[bus_sm];
+    dbus = sample & 0xFF;
+    romc = (sample >> BUS_SAMPLE_ROMC_SHIFT) & 0x1F;
+    bus_response = 0;
+}
+
+/*! \brief Hand the response of the current cycle to the PIO */
+__force_inline void bus_pio_respond() {
+    BUS_PIO->txf[bus_sm] = bus_response;
+}
@@ -0,0 +1,127 @@
+/** \file channel.hpp
+ *
+ * \brief Message channel between the two cores
+ *
+ * \details One lock-free ring in each direction (see ring.hpp). Core 1 never
+ * blocks: it pushes a message and signals an event, which wakes core 0 from
+ * wait_for_message(). Core 0's replies are picked up by core 1 the next time
+ * it handles a port write.
+ *
+ * Core 0 can leave the ring undrained for a while (e.g. while it rebuilds the
+ * directory index), so a post can be dropped. Every sender checks the result
+ * of post_to_core0(), and sends again on a later port write if it failed.
+ *
+ * ### Messages
+ *
+ * | Message      | Direction      | Argument    | Meaning
+ * |--------------|----------------|-------------|--------
+ * | LOAD_GAME    | Core 1 -> 0    | File index  | The menu selected a file
+ * | LOAD_STARTED | Core 0 -> 1    | File index  | The request was accepted
+ * | LOAD_DONE    | Core 0 -> 1    | LOAD_STATUS | The game was loaded (or not)
+ * | FILL_WINDOW  | Core 1 -> 0    | First index | The menu needs other titles (see file_cache.hpp)
+ * | FILL_PAGE    | Core 1 -> 0    | Page slot   | The slot was given a new page of titles (see file_cache.hpp)
+ * | FIND_LETTER  | Core 1 -> 0    | Letter      | The menu wants the first title at or after a letter
+ * | LETTER_FOUND | Core 0 -> 1    | File index  | The answer to FIND_LETTER
+ * | MENU_EXITED  | Core 1 -> 0    | Request     | PC0 has left the Videocart, see wait_for_menu_exit()
+ */
+
+#pragma once
+
+#include "gpio.hpp"
+#include "ring.hpp"
+
+#include <pico/time.h>
+
+namespace MESSAGE {
+    inline constexpr uint8_t LOAD_GAME = 1;
+    inline constexpr uint8_t LOAD_STARTED = 2;
+    inline constexpr uint8_t LOAD_DONE = 3;
+    inline constexpr uint8_t FILL_WINDOW = 4;
+    inline constexpr uint8_t FILL_PAGE = 5;
+    inline constexpr uint8_t FIND_LETTER = 6;
+    inline constexpr uint8_t LETTER_FOUND = 7;
+    inline constexpr uint8_t MENU_EXITED = 8;
+}
+
+namespace LOAD_STATUS {
+    inline constexpr uint16_t OK = 0;
+    inline constexpr uint16_t NOT_FOUND = 1;
+    inline constexpr uint16_t INVALID = 2;
+    inline constexpr uint16_t MENU_STAYED = 3;  // The menu didn't jump to the BIOS, so nothing was loaded
+}
+
+inline constexpr uint32_t MENU_EXIT_TIMEOUT_MS = 1000;  // Longest wait for the menu to jump to the BIOS
+
+struct Message {
+    uint8_t type;
+    uint16_t argument;
+};
+
+inline constexpr uint32_t CHANNEL_SIZE = 16;
+inline SpscRing<Message, CHANNEL_SIZE> core1_to_core0;
+inline SpscRing<Message, CHANNEL_SIZE> core0_to_core1;
+inline volatile uint16_t menu_exit_requested = 0;  // Incremented by core 0 to ask for MENU_EXITED
+inline volatile uint16_t menu_exit_posted = 0;     // Last request answered, only written by core 1
+
+/*! \brief Send a message to core 0 and wake it. Must be called from core 1
+ *
+ * \return false if the ring was full and the message was dropped, in which
+ * case it's up to the caller to post it again later
+ */
+__force_inline bool post_to_core0(const Message &message) {
+    bool posted = core1_to_core0.push(message);
+    __sev();
+    return posted;
+}
+
+/*! \brief Send a message to core 1. Must be called from core 0 */
+inline void post_to_core1(const Message &message) {
+    core0_to_core1.push(message);
+}
+
+/*! \brief Tell core 0 once PC0 has left the Videocart, if it has asked. Must be called from core 1 after each bus cycle
+ *
+ * \param pc The value of PC0
+ */
+__force_inline void menu_exit_check(uint16_t pc) {
+    uint16_t requested = menu_exit_requested;
+    if (requested != menu_exit_posted && pc < VIDEOCART_START_ADDR && post_to_core0({MESSAGE::MENU_EXITED, requested})) {
+        menu_exit_posted = requested;
+    }
+}
+
+/*! \brief Wait for the menu to jump to the BIOS, before its memory is replaced. Must be called from core 0
+ *
+ * \details Core 1 answers with MENU_EXITED from menu_exit_check(). Other
+ * messages that arrive in the meantime are from the menu that is leaving, and
+ * are dropped.
+ *
+ * \return false if the menu didn't jump within MENU_EXIT_TIMEOUT_MS
+ */
+inline bool wait_for_menu_exit() {
+    uint16_t request = menu_exit_requested + 1;
+    menu_exit_requested = request;
+    absolute_time_t timeout = make_timeout_time_ms(MENU_EXIT_TIMEOUT_MS);
+    for (;;) {
+        Message message;
+        while (core1_to_core0.pop(message)) {
+            if (message.type == MESSAGE::MENU_EXITED && message.argument == request) {
+                return true;
+            }
+        }
+        if (best_effort_wfe_or_timeout(timeout)) {
+            return false;
+        }
+    }
+}
+
+/*! \brief Sleep until core 1 posts a message, or a timeout. Must be called from core 0
+ *
+ * \param timeout_ms The longest time to sleep for
+ */
+inline void wait_for_message(uint32_t timeout_ms) {
+    absolute_time_t timeout = make_timeout_time_ms(timeout_ms);
+    while (core1_to_core0.empty() && !best_effort_wfe_or_timeout(timeout)) {
+        ; // Woken by an unrelated event
+    }
+}
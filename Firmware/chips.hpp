@@ -5,134 +5,382 @@
 
 #pragma once
 
+#include "config.hpp"
 #include "default_rom.hpp"
+#include "ring.hpp"
 
-inline uint8_t program_attribute[0x10000]; // Determines chip type for that address
+/*! \brief Page-granular memory map, determines the chip type of each address
+ *
+ * \details Rather than a byte per address, each 256-byte page points to a
+ * 256-byte block of chip types. Pages with a single chip type all share one
+ * block per type, and only pages where a chip starts or ends mid-page get a
+ * block of their own. Looking up an address is two loads and no branches,
+ * the same work as before, while the map takes 5K instead of 64K.
+ *
+ * If the blocks run out, a partially covered page takes the chip type of the
+ * last chip mapped to it.
+ */
+inline constexpr uint8_t ATTRIBUTE_BLOCK_LIMIT = 16;  // Uniform + mixed pages in use at once
+inline uint8_t attribute_blocks[ATTRIBUTE_BLOCK_LIMIT][0x100];
+inline uint8_t attribute_block_type[ATTRIBUTE_BLOCK_LIMIT];  // Chip type of each uniform block
+inline uint8_t uniform_blocks_used = 1;                      // Block 0 is the initial all-ROM block
+inline uint8_t mixed_blocks_used = 0;                        // Mixed blocks are taken from the end
 
-/*! \brief Abstract base class for chip types 
- * 
- * \details This interface is used by the Videocart emulation code to read and
- * write to memory addresses. New chip types can be added by implementing this 
- * interface.
-*/
-class ChipType {
-    public:
-        virtual uint8_t read(uint16_t address) = 0;
-        virtual void write(uint16_t address, uint8_t data) = 0;
-        virtual bool has_data() = 0;
+struct MemoryMap {
+    uint8_t* page[0x100];
+};
+
+constexpr MemoryMap make_memory_map() {
+    MemoryMap map = {};
+    for (auto &page : map.page) {
+        page = attribute_blocks[0];
+    }
+    return map;
+}
+
+inline MemoryMap memory_map = make_memory_map();  // Everything is ROM (chip type 0) until a game is loaded
+
+/*! \brief Get the chip type of an address
+ *
+ * \param address The address to look up
+ * \return The chip type
+ */
+__force_inline uint8_t chip_type_at(uint16_t address) {
+    return memory_map.page[address >> 8][address & 0xFF];
+}
+
+/*! \brief Get the shared block for pages of a single chip type
+ *
+ * \param chip_type The chip type
+ * \return The block, or nullptr if none are left
+ */
+uint8_t* uniform_attribute_block(uint8_t chip_type) {
+    for (uint8_t i = 0; i < uniform_blocks_used; i++) {
+        if (attribute_block_type[i] == chip_type) {
+            return attribute_blocks[i];
+        }
+    }
+    if (uniform_blocks_used + mixed_blocks_used == ATTRIBUTE_BLOCK_LIMIT) {
+        return nullptr;
+    }
+    attribute_block_type[uniform_blocks_used] = chip_type;
+    memset(attribute_blocks[uniform_blocks_used], chip_type, 0x100);
+    return attribute_blocks[uniform_blocks_used++];
+}
+
+/*! \brief Set every address to a single chip type
+ *
+ * \param chip_type The chip type
+ */
+void memory_map_clear(uint8_t chip_type) {
+    uniform_blocks_used = 0;
+    mixed_blocks_used = 0;
+    uint8_t* block = uniform_attribute_block(chip_type);
+    for (auto &page : memory_map.page) {
+        page = block;
+    }
+}
+
+/*! \brief Set the chip type of a range of addresses
+ *
+ * \param address The first address
+ * \param size The number of bytes, clipped to the end of the address space
+ * \param chip_type The chip type
+ */
+void memory_map_set(uint16_t address, uint32_t size, uint8_t chip_type) {
+    uint32_t end = min((uint32_t) address + size, (uint32_t) 0x10000);
+    for (uint32_t page_start = address & 0xFF00; page_start < end; page_start += 0x100) {
+        uint32_t first = max(page_start, (uint32_t) address);
+        uint32_t last = min(page_start + 0x100, end);
+        uint8_t* &page = memory_map.page[page_start >> 8];
+
+        if (first == page_start && last == page_start + 0x100) {  // Whole page
+            uint8_t* block = uniform_attribute_block(chip_type);
+            if (block != nullptr) {
+                page = block;
+                continue;
+            }
+        }
+
+        // Part of a page, give it its own block unless it already has one
+        bool is_mixed = page >= (uint8_t*) (attribute_blocks + ATTRIBUTE_BLOCK_LIMIT - mixed_blocks_used);
+        if (!is_mixed && uniform_blocks_used + mixed_blocks_used < ATTRIBUTE_BLOCK_LIMIT) {
+            mixed_blocks_used++;
+            uint8_t* block = attribute_blocks[ATTRIBUTE_BLOCK_LIMIT - mixed_blocks_used];
+            memcpy(block, page, 0x100);
+            page = block;
+            is_mixed = true;
+        }
+        if (is_mixed) {
+            memset(page + (first - page_start), chip_type, last - first);
+        } else if (uint8_t* block = uniform_attribute_block(chip_type)) {
+            page = block;  // Out of blocks
+        }
+    }
+}
+
+/*! \brief Banked memory
+ *
+ * \details program_rom is bank 0. Every bank has a table of page pointers for
+ * the whole address space, and program_pages points at the table of the
+ * selected bank. Pages a bank has no data for point into program_rom, while
+ * pages it does have data for come from bank_pool. Selecting a bank is
+ * therefore a single store, no matter how large the banked window is.
+ *
+ * All banks share the memory map, so a banked page has the same chip type in
+ * every bank.
+ */
+inline constexpr uint8_t BANK_LIMIT = 16;        // Banks per game, including bank 0
+inline constexpr uint16_t BANK_POOL_PAGES = 256; // 64K of banked pages
+inline uint8_t bank_pool[BANK_POOL_PAGES][0x100];
+inline uint16_t bank_pool_used = 0;
+inline uint8_t bank_count = 1;
+inline uint8_t current_bank = 0;
+
+struct PageTable {
+    uint8_t* page[0x100];
 };
 
+constexpr PageTable make_page_table() {
+    PageTable table = {};
+    for (uint16_t i = 0; i < 0x100; i++) {
+        table.page[i] = program_rom + (i << 8);
+    }
+    return table;
+}
+
+inline PageTable bank_tables[BANK_LIMIT] = {make_page_table()};  // Only bank 0 until a banked game is loaded
+inline PageTable* program_pages = &bank_tables[0];
+
+/*! \brief Go back to a single bank
+ *
+ * \details Bank 0's table is rebuilt too, as the Launcher points one of its
+ * pages at a page of titles (see ports.hpp).
+ */
+void bank_reset() {
+    bank_tables[0] = make_page_table();
+    bank_count = 1;
+    bank_pool_used = 0;
+    current_bank = 0;
+    program_pages = &bank_tables[0];
+}
+
+/*! \brief Get a page of a bank to load data into
+ *
+ * \details The first time a page of a bank is asked for, it's taken from
+ * bank_pool and starts as a copy of the same page of bank 0. Bank 0 must
+ * therefore be fully loaded first, or the bank misses what's loaded after.
+ *
+ * \param bank The bank number
+ * \param page The page number (address >> 8)
+ * \return The page, or nullptr if the bank number is too high or bank_pool is full
+ */
+uint8_t* bank_page(uint8_t bank, uint8_t page) {
+    if (bank == 0) {
+        return program_rom + (page << 8);
+    }
+    if (bank >= BANK_LIMIT) {
+        return nullptr;
+    }
+    while (bank_count <= bank) {
+        bank_tables[bank_count++] = bank_tables[0];
+    }
+    uint8_t* &entry = bank_tables[bank].page[page];
+    if (entry == bank_tables[0].page[page]) {
+        if (bank_pool_used == BANK_POOL_PAGES) {
+            return nullptr;
+        }
+        memcpy(bank_pool[bank_pool_used], entry, 0x100);
+        entry = bank_pool[bank_pool_used++];
+    }
+    return entry;
+}
+
+/*! \brief Make a bank visible to the CPU
+ *
+ * \param bank The bank number, ignored if there is no such bank
+ */
+__force_inline void bank_select(uint8_t bank) {
+    if (bank < bank_count) {
+        program_pages = &bank_tables[bank];
+        current_bank = bank;
+    }
+}
+
+/*! \brief Get the byte at an address in the selected bank */
+__force_inline uint8_t& program_byte(uint16_t address) {
+    return program_pages->page[address >> 8][address & 0xFF];
+}
+
+/*! \brief Pages written since the last save state snapshot (see save_state.hpp)
+ *
+ * \details A byte per page rather than a bit, so core 1 marks a page with a
+ * single store, and core 0 can unmark it without a read-modify-write that
+ * could lose a mark made in between. Pages from DIRTY_SRAM_PAGE on hold the
+ * 2102 SRAM (see ports.hpp).
+ */
+inline constexpr uint16_t DIRTY_SRAM_PAGE = 0x100;
+inline constexpr uint16_t DIRTY_PAGES = DIRTY_SRAM_PAGE + 4;
+inline volatile uint8_t dirty_pages[DIRTY_PAGES];
+
+/*! \brief Mark a page as written, if save states are enabled */
+__force_inline void mark_dirty(uint16_t page) {
+    if constexpr (SAVE_STATES) {
+        dirty_pages[page] = 1;
+    }
+}
+
+/*! \brief Chip types
+ *
+ * \details Each chip type is a class of static members, and with_chip_type()
+ * turns a chip type id into a call on the matching class. Every access is
+ * therefore resolved at compile time, with no virtual calls. New chip types can
+ * be added by writing a class with the same members and adding a case to
+ * with_chip_type().
+ *
+ * Reads happen on every instruction fetch, so they are never dispatched. A
+ * chip type that doesn't read back program_rom gives the value it reads
+ * instead, and map_chip() fills its region of program_rom with that value.
+ * Since such chips also ignore writes, read_program_byte() stays a single
+ * array read for every chip type.
+ *
+ * | Member         | Description
+ * |----------------|------------
+ * | id             | Chip type id, as used by CHF files
+ * | has_data       | The CHF chip packet carries data to load
+ * | reads_memory   | Reads return program_rom, otherwise read_value
+ * | write()        | Handle a write from the CPU
+ */
+
 /*! \brief Read-only memory */
-class ROM_CT : public ChipType {
+class ROM_CT {
     public:
         static constexpr uint16_t id = 0;
-        ROM_CT() = default;
-        uint8_t read(uint16_t address) {
-            return program_rom[address];
-        }
-        void write(uint16_t address, uint8_t data) {}
-        bool has_data() {
-            return true;
-        }
+        static constexpr bool has_data = true;
+        static constexpr bool reads_memory = true;
+        static constexpr uint8_t read_value = 0xFF;
+        __force_inline static void write(uint16_t address, uint8_t data) {}
 };
 
 /*! \brief Read/Write memory */
-class RAM_CT : public ChipType {
+class RAM_CT {
     public:
         static constexpr uint16_t id = 1;
-        RAM_CT() = default;
-        uint8_t read(uint16_t address) {
-            return program_rom[address];
-        }
-        void write(uint16_t address, uint8_t data) {
-            program_rom[address] = data;
-        }
-        bool has_data() {
-            return false;
+        static constexpr bool has_data = false;
+        static constexpr bool reads_memory = true;
+        static constexpr uint8_t read_value = 0xFF;
+        __force_inline static void write(uint16_t address, uint8_t data) {
+            program_byte(address) = data;
+            mark_dirty(address >> 8);
         }
 };
 
 /*! \brief Similar to ROM, but toggles the LED when written to */
-class LED_CT : public ChipType {
+class LED_CT {
     public:
         static constexpr uint16_t id = 2;
-        LED_CT() = default;
-        uint8_t read(uint16_t address) {
-            return program_rom[address];
-        }
-        void write(uint16_t address, uint8_t data) {
+        static constexpr bool has_data = true;
+        static constexpr bool reads_memory = true;
+        static constexpr uint8_t read_value = 0xFF;
+        __force_inline static void write(uint16_t address, uint8_t data) {
             gpio_xor_mask(1 << LED_BUILTIN); // Toggle LED
         }
-        bool has_data() {
-            return true;
-        }
 };
 
-/*! \brief Non-volatile RAM (data is preserved between power cycles) */
-class NVRAM_CT : public ChipType {
+/*! \brief An NVRAM write waiting to be stored in FRAM */
+struct NvramWrite {
+    uint16_t address;
+    uint8_t data;
+};
+
+inline constexpr uint32_t NVRAM_RING_SIZE = 512;
+inline SpscRing<NvramWrite, NVRAM_RING_SIZE> nvram_writes;  // Pushed by core 1, drained to FRAM by core 0
+
+/*! \brief Non-volatile RAM (data is preserved between power cycles)
+ *
+ * \details program_rom holds a mirror of the data, and every write is queued
+ * for core 0 to store in FRAM (see fram.hpp).
+ */
+class NVRAM_CT {
     public:
         static constexpr uint16_t id = 3;
-        NVRAM_CT() = default;
-        uint8_t read(uint16_t address) { // TODO: implement NVRAM read
-            return -1;
-        }
-        void write(uint16_t address, uint8_t data) {} // TODO: implement NVRAM write
-        bool has_data() {
-            return true;
+        static constexpr bool has_data = true;
+        static constexpr bool reads_memory = true;
+        static constexpr uint8_t read_value = 0xFF;
+        __force_inline static void write(uint16_t address, uint8_t data) {
+            program_byte(address) = data;
+            nvram_writes.push({address, data});
         }
 };
 
 /*! \brief Cannot be read/written to */
-class RESERVED_CT : public ChipType {
+class RESERVED_CT {
     public:
         static constexpr uint16_t id = 0xFF;
-        RESERVED_CT() = default;
-        uint8_t read(uint16_t address) {return -1;}
-        void write(uint16_t address, uint8_t data) {}
-        bool has_data() {return false;}
+        static constexpr bool has_data = false;
+        static constexpr bool reads_memory = false;
+        static constexpr uint8_t read_value = 0xFF;
+        __force_inline static void write(uint16_t address, uint8_t data) {}
 };
-ChipType* ChipTypes[] = {new ROM_CT(), new RAM_CT(), new LED_CT(), new NVRAM_CT()}; //FIXME: use below format
-// ChipType* ChipTypes[256];
-// ChipTypes[ROM_CT::id] = new ROM_CT();
-// ChipTypes[RAM_CT::id] = new RAM_CT();
-// ChipTypes[LED_CT::id] = new LED_CT();
-// ChipTypes[NVRAM_CT::id] = new NVRAM_CT();
+
+/*! \brief Call a function with the class of a chip type
+ *
+ * \details Unknown chip types are treated as RESERVED_CT.
+ *
+ * \param chip_type The chip type id
+ * \param f A generic lambda taking the chip type class, e.g. [](auto chip) {return decltype(chip)::has_data;}
+ * \return Whatever f returns
+ */
+template <typename F>
+__force_inline auto with_chip_type(uint16_t chip_type, F f) {
+    switch (chip_type) {
+        case ROM_CT::id:
+            return f(ROM_CT());
+        case RAM_CT::id:
+            return f(RAM_CT());
+        case LED_CT::id:
+            return f(LED_CT());
+        case NVRAM_CT::id:
+            return f(NVRAM_CT());
+        default:
+            return f(RESERVED_CT());
+    }
+}
+
+/*! \brief Check if the CHF chip packet of a chip type carries data */
+bool chip_has_data(uint16_t chip_type) {
+    return with_chip_type(chip_type, [](auto chip) {return decltype(chip)::has_data;});
+}
+
+/*! \brief Set the chip type of a range of addresses, and prepare it for reads
+ *
+ * \param address The first address
+ * \param size The number of bytes, clipped to the end of the address space
+ * \param chip_type The chip type
+ */
+void map_chip(uint16_t address, uint32_t size, uint16_t chip_type) {
+    size = min(size, (uint32_t) 0x10000 - address);
+    memory_map_set(address, size, chip_type > 0xFF ? RESERVED_CT::id : chip_type);
+    with_chip_type(chip_type, [&](auto chip) {
+        if (!decltype(chip)::reads_memory) {
+            memset(program_rom + address, decltype(chip)::read_value, size);
+        }
+    });
+}
 
 // Program ROM functions
 
 /*! \brief Get the content of the memory address in the program ROM
+ *
+ * \details Chip types that don't read back memory were given their read
+ * value by map_chip(), so this is correct for every chip type. Reads come from
+ * the selected bank.
  *
  * \param address The location of the data
  * \return The content of the memory address
  */
-__force_inline uint8_t read_program_byte(uint16_t address) {   
-    // nullcheck
-    // ChipTypes[program_attribute[address]]->read(address);
-    
-    // switch (program_attribute[address]) {
-    //     case ROM_CT::id:
-    //         return ROM_CT.read(address);
-    //     case RAM_CT::id:
-    //         return RAM_CT.read(address);
-    //     case LED_CT::id:
-    //         return LED_CT.read(address);
-    //     case NVRAM_CT::id:
-    //         return NVRAM_CT.read(address);
-    //     default:
-    //         return 0xFF;
-    // }
-
-    // switch (program_attribute[address]) {
-    //     case ROM_CT::id:
-    //     case RAM_CT::id:
-    //     case LED_CT::id:
-    //     case NVRAM_CT::id:
-    //         return program_rom[address];
-    //     default:
-    //         return 0xFF;
-    // }
-
-    return program_rom[address];
+__force_inline uint8_t read_program_byte(uint16_t address) {
+    return program_byte(address);
 }
 
 /*! \brief Set the content of the memory address in the program ROM
@@ -141,23 +389,7 @@ __force_inline uint8_t read_program_byte(uint16_t address) {
  * \param data The byte to be written
  */
 __force_inline void write_program_byte(uint16_t address, uint8_t data) {
-    switch (program_attribute[address]) {
-        case RAM_CT::id:
-            program_rom[address] = data;
-    }
-
-    //nullcheck
-    // ChipTypes[program_attribute[address]]->write(address, data);
-
-    // switch (program_attribute[address]) {
-    //     case RAM_CT::id:
-    //         RAM_CT.write(address, data);
-    //         break;
-    //     case LED_CT::id:
-    //         LED_CT.write(address, data);
-    //         break;
-    //     case NVRAM_CT::id:
-    //         LED_CT.write(address, data);
-    //         break;
-    // }
-}
\ No newline at end of file
+    with_chip_type(chip_type_at(address), [=](auto chip) {
+        decltype(chip)::write(address, data);
+    });
+}
@@ -0,0 +1,94 @@
+/** \file config.hpp
+ *
+ * \brief Build-time firmware options
+ *
+ * \details Diagnostic features are disabled by default, as they either take
+ * over a core or add work to the bus loop. Change the values below and rebuild
+ * to enable them.
+ */
+
+#pragma once
+
+#include <hardware/vreg.h>
+
+/*! \brief Run the ROMC benchmark on core 1 instead of serving the bus
+ *
+ * \details Results are printed over USB serial. The data bus is driven while
+ * the benchmark runs, so the Pico must not be plugged into a console.
+ */
+inline constexpr bool ROMC_BENCHMARK = false;
+
+// Print runtime statistics over USB serial (see diagnostics.hpp)
+inline constexpr bool SERIAL_DIAGNOSTICS = false;
+inline constexpr uint32_t DIAGNOSTICS_PERIOD_MS = 5000;
+
+/*! \brief Serve the bus through a PIO state machine instead of polling WRITE
+ *
+ * \details See bus_pio.hpp. As the PIO handles edges and buffer enables, core 1
+ * only has to compute the response, which lets it run without the overclock.
+ */
+inline constexpr bool PIO_BUS_FRONTEND = false;
+
+/*! \brief Record bus cycles to the SD card, or to USB serial
+ *
+ * \details See trace.hpp. Set the trigger with trace_trigger. Serial output is
+ * binary, so it can't be used together with SERIAL_DIAGNOSTICS.
+ */
+inline constexpr bool BUS_TRACE = false;
+inline constexpr bool TRACE_TO_SERIAL = false;
+static_assert(!(BUS_TRACE && TRACE_TO_SERIAL && SERIAL_DIAGNOSTICS), "The trace and diagnostics can't share USB serial");
+
+/*! \brief Replay a bus trace through execute_romc() on core 1 instead of serving the bus
+ *
+ * \details See replay.hpp. Checks the registers against a trace recorded with
+ * BUS_TRACE, and times the bus path. As with ROMC_BENCHMARK, the data bus is
+ * driven, so the Pico must not be plugged into a console.
+ */
+inline constexpr bool TRACE_REPLAY = false;
+static_assert(!(TRACE_REPLAY && (ROMC_BENCHMARK || BUS_TRACE)), "The trace replay takes over core 1 on its own");
+
+/*! \brief Time every bus cycle, and keep histograms for each ROMC code
+ *
+ * \details See latency.hpp. Adds two counter reads and a histogram update to
+ * every cycle. Reported with SERIAL_DIAGNOSTICS.
+ */
+inline constexpr bool BUS_LATENCY = false;
+
+/*! \brief Time the directory index and ROM loading at each SD clock, then print the report over USB serial
+ *
+ * \details See sd_benchmark.hpp. Games are loaded over the menu, so the Pico
+ * must not be plugged into a console.
+ */
+inline constexpr bool SD_BENCHMARK = false;
+
+/*! \brief Save the RAM of a running game to the SD card, and restore it when it's loaded again
+ *
+ * \details See save_state.hpp. Adds a store to every RAM write, and has core 0
+ * write to the SD card while games run.
+ */
+inline constexpr bool SAVE_STATES = false;
+
+/*! \brief CHF hardware_type that gets the MK3870/3871 ports (see mk3870.hpp)
+ *
+ * \details Provisional: the CHF header docs don't list a value for MK3870
+ * carts yet. Change it to match the images in use until the spec assigns one.
+ */
+inline constexpr uint16_t MK3870_HARDWARE_TYPE = 0x0003;
+
+// System clock and core voltage set by setup1()
+inline constexpr uint32_t SYS_CLOCK_KHZ = PIO_BUS_FRONTEND ? 250000 : 400000;  // 428000 is known to work on some devices
+inline constexpr vreg_voltage CORE_VOLTAGE = PIO_BUS_FRONTEND ? VREG_VOLTAGE_DEFAULT : VREG_VOLTAGE_1_30;
+
+/*! \brief Work out the next data bus value while WRITE is low
+ *
+ * \details See prefetch_romc(). Fetches then only select and drive a byte that
+ * is already known at the rising edge.
+ */
+inline constexpr bool SPECULATIVE_FETCH = true;
+
+/*! \brief Keep recently loaded ROM files in QSPI flash
+ *
+ * \details See flash_cache.hpp. The menu starts from flash before the SD card
+ * is ready, and cached games are loaded without reading the SD card.
+ */
+inline constexpr bool FLASH_CACHE = true;
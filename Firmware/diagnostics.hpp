@@ -0,0 +1,78 @@
+/** \file diagnostics.hpp
+ *
+ * \brief Runtime statistics reported over USB serial
+ *
+ * \details Core 1 only ever increments plain counters, so reporting is left to
+ * core 0, which prints everything here every DIAGNOSTICS_PERIOD_MS when
+ * SERIAL_DIAGNOSTICS is set in config.hpp. Counters may be a cycle out of date
+ * when read, which is fine for statistics.
+ */
+
+#pragma once
+
+#include "config.hpp"
+#include "file_cache.hpp"
+#include "flash_cache.hpp"
+#include "latency.hpp"
+#include "loader.hpp"
+#include "romc.hpp"
+#include "save_state.hpp"
+#include "sd_card.hpp"
+#include "interrupts.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
+
+/*! \brief Print all runtime statistics
+ *
+ * \param out Where to print the report (e.g. Serial)
+ */
+void print_diagnostics(Print &out) {
+    uint32_t count = prefetch_count;
+    uint32_t hits = prefetch_hits;
+    out.printf("NVRAM ring: high water %lu/%lu, dropped %lu\n", nvram_writes.high_water, NVRAM_RING_SIZE, nvram_writes.dropped);
+    out.printf("Messages to core 0: high water %lu/%lu, dropped %lu\n", core1_to_core0.high_water, CHANNEL_SIZE,
+               core1_to_core0.dropped);
+    out.printf("Port writes held back during flash writes: high water %lu/%lu, dropped %lu\n", deferred_writes.high_water,
+               DEFERRED_WRITES_SIZE, deferred_writes.dropped);
+    out.printf("Directory: %u entries, open %lu ms, check %lu ms, %lu rebuilds (last %lu ms), %lu window fills (max %lu us), %lu page fills (max %lu us)\n",
+               directory_size, directory_stats.open_ms, directory_stats.verify_ms, directory_stats.rebuilds,
+               directory_stats.build_ms, directory_stats.fills, directory_stats.fill_us_max, directory_stats.page_fills,
+               directory_stats.page_fill_us_max);
+    out.printf("Last selected: entry %u of %u, opened in %lu us, loaded %lu ms after selecting\n", directory_stats.last_index,
+               directory_size, directory_stats.last_open_us, directory_stats.last_select_ms);
+    for (uint8_t format = 0; format < LOAD_FORMAT::COUNT; format++) {
+        LoadStats &stats = load_stats[format];
+        if (stats.loads != 0) {
+            out.printf("%s load: %lu bytes (%lu loaded) in %lu.%03lu ms (%lu KB/s loaded), %lu SD reads\n", LOAD_FORMAT_NAMES[format],
+                       stats.bytes, stats.loaded, stats.us / 1000, stats.us % 1000,
+                       stats.us ? (uint32_t) (stats.loaded * 1000ull / stats.us) : 0, stats.reads);
+        }
+    }
+    for (uint8_t phase = 0; phase < STARTUP::COUNT; phase++) {
+        StartupPhase &time = startup_phases[phase];
+        out.printf("Startup %s: %lu us to %lu us (%lu us)\n", STARTUP_PHASE_NAMES[phase], time.start_us, time.end_us,
+                   time.end_us - time.start_us);
+    }
+    out.printf("SD card: %lu MHz, %lu attempts, %lu clocks rejected\n", sd_stats.speed_hz / 1000000, sd_stats.attempts,
+               sd_stats.rejected);
+    FlashCacheStats &cache = flash_cache_stats;
+    out.printf("Boot: menu from %s, loaded %lu us and first fetch %lu us after power on\n", cache.boot_from_cache ? "flash" : "SD",
+               cache.boot_ready_us, cache.first_fetch_us);
+    out.printf("Flash cache: %s, %lu hits, %lu misses, %lu slots written, %lu out of date\n",
+               flash_cache_available() ? "on" : "off", cache.hits, cache.misses, cache.writes, cache.stale);
+    if constexpr (SAVE_STATES) {
+        print_save_stats(out);
+    }
+    InterruptSource* sources = interrupt_sources;
+    out.printf("Interrupts: SMI timer %lu, SMI external %lu, MK3870 timer %lu, MK3870 external %lu\n",
+               sources[INTERRUPT::SMI_TIMER].count, sources[INTERRUPT::SMI_EXTERNAL].count,
+               sources[INTERRUPT::MK3870_TIMER].count, sources[INTERRUPT::MK3870_EXTERNAL].count);
+    if constexpr (BUS_TRACE) {
+        out.printf("Trace: %lu records in %lu blocks (max %lu us), %lu dropped, ring high water %lu/%lu\n", trace_stats.records,
+                   trace_stats.blocks, trace_stats.write_us_max, bus_trace.dropped, bus_trace.high_water, TRACE_RING_SIZE);
+    }
+    if constexpr (BUS_LATENCY) {
+        print_latency(out);
+    }
+    out.printf("Prefetch: %lu cycles, %lu fetches served (%lu%%)\n", count, hits, count ? (uint32_t) (hits * 100ull / count) : 0);
+}
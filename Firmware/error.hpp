@@ -8,6 +8,7 @@
 namespace BLINK {
     inline constexpr uint8_t OVERCLOCK_FAILED = 3;
     inline constexpr uint8_t NO_VALID_FILES = 4;
+    inline constexpr uint8_t INVALID_FILE = 5;
 }
 
 /*! \brief Blink an error code to the LED. Useful for simple debugging
@@ -1,39 +1,78 @@
 /** \file file_cache.hpp
- * 
+ *
  * \brief Handles most code related to loading ROMS
- * 
+ *
  * \details Unfortunately, the SD card cannot be accessed while a program is running
  * on core 1. To allow a menu program to work, a cache must be built that can store the
  * directory structure of the SD card.
- * 
- * The current incarnation only supports a flat directory of 100 files or less
- * 
+ *
+ * The cache is an index file on the SD card (INDEX_PATH), holding every entry of
+ * the root directory sorted by name. It is only rebuilt when the directory
+ * changes, so booting takes the same time whatever the size of the library:
+ *
+ * 1. directory_open() reads the index header and the first window of titles.
+ *    Only a missing or unreadable index is rebuilt before the menu starts.
+ * 2. directory_verify_step() then walks the directory a few entries at a time
+ *    from loop(), hashing the name, size and write time of every entry into a
+ *    signature. If it doesn't match the one stored in the index, the index is
+ *    rebuilt.
+ *
+ * Building the index is an external merge sort: the directory is read in runs
+ * of SORT_RUN_SIZE entries that are sorted in RAM, then the runs are merged
+ * through two scratch files until one is left. RAM use doesn't depend on the
+ * number of entries.
+ *
+ * Core 1 never touches the SD card. The Launcher reads titles from one of two
+ * windows of WINDOW_SIZE entries. When the selection gets close to the edge of
+ * the current window, it posts FILL_WINDOW to core 0, which fills the other
+ * window from the index and swaps them.
+ *
+ * The Launcher can also show a whole page of PAGE_TITLES titles at once. Each
+ * page is filled on core 0, from the index, into one of PAGE_SLOTS slots, and
+ * the pages either side of the shown one are filled ahead of time. Core 1 then
+ * only has to point a page of memory at a slot (see ports.hpp).
+ *
+ * Every entry also records where its full file name is kept in the index, so
+ * a selected game is opened with a single SD.open(), whatever its position in
+ * the directory, instead of walking the directory to it again.
+ *
+ * ### Index file
+ *
+ * | Offset                                           | Size                | Content
+ * |--------------------------------------------------|---------------------|--------
+ * | 0                                                | sizeof(IndexHeader) | IndexHeader
+ * | sizeof(IndexHeader) + i * sizeof(file_info)      | sizeof(file_info)   | Entry i, in title order
+ * | sizeof(IndexHeader) + count * sizeof(file_info)  | To the end          | File names, null terminated
+ *
  * ### Limitations
- * 
- * | Name                 | Min | Max  | Same as FAT32
- * |----------------------|-----|------|--------------
- * | File size            |   0 | 4 GB | Yes
- * | File name            |   1 |  255 | Yes
- * | File/Dir per SD card |   0 |  100 | No (268,435,437)
- * | File/Dir per Dir     |   0 |  100 | No (65,536)
- * | Directory depth      |   0 |    0 | No (128)
+ *
+ * | Name                 | Min | Max    | Same as FAT32
+ * |----------------------|-----|--------|--------------
+ * | File size            |   0 | 4 GB   | Yes
+ * | File name            |   1 |  255   | Yes
+ * | File/Dir per SD card |   0 | 65,535 | No (268,435,437)
+ * | File/Dir per Dir     |   0 | 65,535 | No (65,536)
+ * | Directory depth      |   0 |    0   | No (128)
  */
 
 #pragma once
 
-inline constexpr uint16_t FOLDER_LIMIT = 100; // Max files displayed per folder
-inline uint16_t DIR_LIMIT = 0;                // Max index into file_data
+#include "channel.hpp"
+
+#include <SD.h>
+
+inline constexpr uint32_t INDEX_LIMIT = 0xFFFF;  // Max entries in the index
+inline volatile uint16_t directory_size = 0;     // Number of entries in the index
 
 struct __attribute__((packed)) file_info {
     char title[32];
     bool isFile;
+    uint32_t name_offset;  // Position of the full file name in the name table
 };
 
-inline file_info file_data[FOLDER_LIMIT] = {0};
+void string_copy(char* destination, const char* source, uint8_t size, bool write_null=false, char pad_char=' ');
 
-void string_copy(char* destination, char* source, uint8_t size, bool write_null=false, char pad_char=' ');
-
-__force_inline void string_copy(char* destination, char* source, uint8_t size, bool write_null, char pad_char) {
+__force_inline void string_copy(char* destination, const char* source, uint8_t size, bool write_null, char pad_char) {
     size_t source_len = strlen(source);
     for (uint16_t i = 0; (i < size) && (i < source_len); i++) {
         destination[i] = source[i];
@@ -44,4 +83,627 @@ __force_inline void string_copy(char* destination, char* source, uint8_t size, b
     if (write_null) {
         destination[size] = '\0';
     }
-}
\ No newline at end of file
+}
+
+// Index file
+
+inline constexpr char INDEX_PATH[] = "/.pvcindex";
+inline constexpr char INDEX_TEMP_PATH[] = "/.pvcindex.tmp";
+inline constexpr char NAMES_TEMP_PATH[] = "/.pvcnames.tmp";
+inline constexpr char SORT_PATHS[2][12] = {"/.pvcsort0", "/.pvcsort1"};
+inline constexpr char INDEX_FILE_PREFIX[] = ".pvc";  // Our own files are left out of the index
+inline constexpr uint32_t INDEX_MAGIC = 0x49435650;  // "PVCI"
+inline constexpr uint16_t INDEX_VERSION = 2;
+
+struct IndexHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t count;
+    uint32_t signature;  // Signature of the directory when the index was built
+};
+
+inline File directory_index;  // Kept open, as opening a file means searching the directory
+
+struct DirectoryStats {
+    uint32_t build_ms;         // Time taken by the last rebuild
+    uint32_t verify_ms;        // Time taken by the last signature check
+    uint32_t open_ms;          // Time taken by directory_open()
+    uint32_t fill_us_max;      // Slowest window fill
+    uint32_t fills;
+    uint32_t page_fill_us_max; // Slowest title page fill
+    uint32_t page_fills;
+    uint32_t rebuilds;
+    uint16_t last_index;       // Index of the last game selected
+    uint32_t last_open_us;     // Time taken to find and open it
+    uint32_t last_select_ms;   // Time from the menu selecting it to it being loaded
+};
+
+inline DirectoryStats directory_stats = {};
+
+/*! \brief Check if a directory entry is one of our own files */
+__force_inline bool is_index_file(const char* name) {
+    return strncmp(name, INDEX_FILE_PREFIX, sizeof(INDEX_FILE_PREFIX) - 1) == 0;
+}
+
+/*! \brief Add a directory entry to a signature (FNV-1a)
+ *
+ * \param signature The signature so far
+ * \param entry The directory entry
+ * \return The new signature
+ */
+uint32_t signature_add(uint32_t signature, File &entry) {
+    auto add_byte = [&](uint8_t byte) {
+        signature = (signature ^ byte) * 16777619u;
+    };
+    for (const char* c = entry.name(); *c != '\0'; c++) {
+        add_byte(*c);
+    }
+    uint32_t values[] = {(uint32_t) entry.size(), (uint32_t) entry.getLastWrite(), entry.isDirectory()};
+    for (uint32_t value : values) {
+        for (uint8_t i = 0; i < 4; i++) {
+            add_byte(value >> (8 * i));
+        }
+    }
+    return signature;
+}
+
+inline constexpr uint32_t SIGNATURE_SEED = 2166136261u;
+
+// Sorting
+
+inline constexpr uint16_t SORT_RUN_SIZE = 64;     // Entries sorted in RAM at a time
+inline constexpr uint16_t SORT_STREAM_SIZE = 16;  // Entries buffered per merge input/output
+
+/*! \brief Order entries by name, ignoring the '/' or ' ' in front of it and case */
+int compare_entries(const file_info &a, const file_info &b) {
+    int order = strcasecmp(a.title + 1, b.title + 1);
+    return order != 0 ? order : (a.name_offset > b.name_offset) - (a.name_offset < b.name_offset);
+}
+
+/*! \brief Buffered reader for a sorted run of entries in a file */
+class RunReader {
+    private:
+        File &file;
+        uint32_t next;   // Entry to read into the buffer next
+        uint32_t end;    // Entry after the last of the run
+        file_info buffer[SORT_STREAM_SIZE];
+        uint16_t position = 0;
+        uint16_t length = 0;
+
+    public:
+        RunReader(File &file, uint32_t begin, uint32_t end): file(file), next(begin), end(end) {}
+
+        /*! \brief Get the next entry without taking it, or nullptr at the end of the run */
+        const file_info* peek() {
+            if (position == length) {
+                uint32_t count = min(end - next, (uint32_t) SORT_STREAM_SIZE);
+                if (count == 0 || !file.seek(next * sizeof(file_info))) {
+                    return nullptr;
+                }
+                length = file.read((uint8_t*) buffer, count * sizeof(file_info)) / sizeof(file_info);
+                position = 0;
+                next += length;
+                if (length == 0) {
+                    return nullptr;
+                }
+            }
+            return &buffer[position];
+        }
+
+        void take() {
+            position++;
+        }
+};
+
+/*! \brief Buffered writer for entries */
+class EntryWriter {
+    private:
+        File &file;
+        file_info buffer[SORT_STREAM_SIZE];
+        uint16_t length = 0;
+
+    public:
+        bool failed = false;
+
+        EntryWriter(File &file): file(file) {}
+
+        void write(const file_info &entry) {
+            buffer[length++] = entry;
+            if (length == SORT_STREAM_SIZE) {
+                flush();
+            }
+        }
+
+        void flush() {
+            size_t size = length * sizeof(file_info);
+            failed |= file.write((uint8_t*) buffer, size) != size;
+            length = 0;
+        }
+};
+
+/*! \brief Merge pairs of sorted runs
+ *
+ * \param source Runs of width entries
+ * \param destination Where to write runs of 2 * width entries
+ * \param count Total number of entries
+ * \param width Entries per run in source
+ * \return false if writing failed
+ */
+bool merge_runs(File &source, File &destination, uint32_t count, uint32_t width) {
+    EntryWriter writer(destination);
+    for (uint32_t low = 0; low < count; low += 2 * width) {
+        uint32_t middle = min(low + width, count);
+        uint32_t high = min(low + 2 * width, count);
+        RunReader left(source, low, middle);
+        RunReader right(source, middle, high);
+        const file_info* a = left.peek();
+        const file_info* b = right.peek();
+        while (a != nullptr || b != nullptr) {
+            if (b == nullptr || (a != nullptr && compare_entries(*a, *b) <= 0)) {
+                writer.write(*a);
+                left.take();
+                a = left.peek();
+            } else {
+                writer.write(*b);
+                right.take();
+                b = right.peek();
+            }
+        }
+    }
+    writer.flush();
+    return !writer.failed;
+}
+
+/*! \brief Open a file for writing, replacing any existing file */
+File create_file(const char* path) {
+    SD.remove(path);
+    return SD.open(path, FILE_WRITE);
+}
+
+/*! \brief Copy a file onto the end of another
+ *
+ * \param destination The file to add to
+ * \param path The file to copy
+ * \return false if reading or writing failed
+ */
+bool append_file(File &destination, const char* path) {
+    File source = SD.open(path, FILE_READ);
+    if (!source) {
+        return false;
+    }
+    static uint8_t buffer[512];
+    for (size_t length; (length = source.read(buffer, sizeof(buffer))) > 0;) {
+        if (destination.write(buffer, length) != length) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*! \brief Scan the root directory and write a new index. Must be called from core 0
+ *
+ * \return true if the index was written
+ */
+bool directory_build() {
+    uint32_t start_ms = millis();
+    directory_index.close();
+    directory_size = 0;
+
+    // Pass 0: sorted runs of SORT_RUN_SIZE entries
+    static file_info run[SORT_RUN_SIZE];
+    File runs = create_file(SORT_PATHS[0]);
+    if (!runs) {
+        return false;
+    }
+    EntryWriter run_writer(runs);
+    uint32_t count = 0;
+    uint16_t run_length = 0;
+    uint32_t signature = SIGNATURE_SEED;
+    auto write_run = [&]() {
+        qsort(run, run_length, sizeof(file_info), [](const void* a, const void* b) {
+            return compare_entries(*(const file_info*) a, *(const file_info*) b);
+        });
+        for (uint16_t i = 0; i < run_length; i++) {
+            run_writer.write(run[i]);
+        }
+        run_length = 0;
+    };
+
+    File names = create_file(NAMES_TEMP_PATH);
+    if (!names) {
+        return false;
+    }
+    uint32_t names_size = 0;
+    bool names_failed = false;
+
+    File dir = SD.open("/");
+    for (File entry = dir.openNextFile(); entry && count < INDEX_LIMIT; entry = dir.openNextFile()) {
+        const char* name = entry.name();
+        if (is_index_file(name)) {
+            continue;
+        }
+        signature = signature_add(signature, entry);
+        file_info &info = run[run_length++];
+        info.title[0] = entry.isDirectory() ? '/' : ' ';
+        string_copy(info.title + 1, name, 30, true, '\0');
+        info.isFile = !entry.isDirectory();
+        info.name_offset = names_size;
+        size_t name_size = strlen(name) + 1;
+        names_failed |= names.write((const uint8_t*) name, name_size) != name_size;
+        names_size += name_size;
+        count++;
+        if (run_length == SORT_RUN_SIZE) {
+            write_run();
+        }
+    }
+    dir.close();
+    write_run();
+    run_writer.flush();
+    runs.close();
+    names.close();
+    if (run_writer.failed || names_failed) {
+        return false;
+    }
+
+    // Merge runs until one is left, the last merge writes the index
+    IndexHeader header = {INDEX_MAGIC, INDEX_VERSION, sizeof(file_info), count, signature};
+    uint8_t source = 0;
+    for (uint32_t width = SORT_RUN_SIZE; ; width *= 2) {
+        bool last = 2 * width >= count;
+        File input = SD.open(SORT_PATHS[source], FILE_READ);
+        File output = create_file(last ? INDEX_TEMP_PATH : SORT_PATHS[source ^ 1]);
+        if (!input || !output) {
+            return false;
+        }
+        if (last && output.write((uint8_t*) &header, sizeof(header)) != sizeof(header)) {
+            return false;
+        }
+        if (!merge_runs(input, output, count, width)) {
+            return false;
+        }
+        if (last && !append_file(output, NAMES_TEMP_PATH)) {
+            return false;
+        }
+        input.close();
+        output.close();
+        source ^= 1;
+        if (last) {
+            break;
+        }
+    }
+    SD.remove(SORT_PATHS[0]);
+    SD.remove(SORT_PATHS[1]);
+    SD.remove(NAMES_TEMP_PATH);
+    SD.remove(INDEX_PATH);
+    if (!SD.rename(INDEX_TEMP_PATH, INDEX_PATH)) {
+        return false;
+    }
+
+    directory_stats.build_ms = millis() - start_ms;
+    directory_stats.rebuilds++;
+    return true;
+}
+
+/*! \brief Open the index and check its header
+ *
+ * \param signature Set to the signature stored in the index
+ * \return true if the index can be used
+ */
+bool directory_open_index(uint32_t &signature) {
+    directory_index = SD.open(INDEX_PATH, FILE_READ);
+    IndexHeader header;
+    if (!directory_index || directory_index.read((uint8_t*) &header, sizeof(header)) != sizeof(header)) {
+        return false;
+    }
+    if (header.magic != INDEX_MAGIC || header.version != INDEX_VERSION || header.entry_size != sizeof(file_info)
+        || header.count > INDEX_LIMIT || directory_index.size() < sizeof(header) + header.count * sizeof(file_info)) {
+        return false;
+    }
+    directory_size = header.count;
+    signature = header.signature;
+    return true;
+}
+
+/*! \brief Read one entry of the index. Must be called from core 0
+ *
+ * \param index Position of the entry in the index
+ * \param entry Where to store the entry
+ * \return false if the entry couldn't be read
+ */
+bool directory_read(uint16_t index, file_info &entry) {
+    return index < directory_size && directory_index.seek(sizeof(IndexHeader) + index * sizeof(file_info))
+           && directory_index.read((uint8_t*) &entry, sizeof(entry)) == sizeof(entry);
+}
+
+/*! \brief Open the file of an index entry. Must be called from core 0
+ *
+ * \param index Position of the entry in the index
+ * \return The file, which is false if it couldn't be opened
+ */
+File directory_open_file(uint16_t index) {
+    file_info entry;
+    File file;
+    if (!directory_read(index, entry)) {
+        return file;
+    }
+    char path[258] = "/";  // '/' + 255 characters + '\0'
+    uint32_t names_start = sizeof(IndexHeader) + directory_size * sizeof(file_info);
+    if (!directory_index.seek(names_start + entry.name_offset)) {
+        return file;
+    }
+    size_t length = directory_index.read((uint8_t*) path + 1, sizeof(path) - 2);
+    path[length + 1] = '\0';  // Names are null terminated, this only guards a damaged index
+    return SD.open(path, FILE_READ);
+}
+
+// Title windows
+
+inline constexpr uint16_t WINDOW_SIZE = 64;    // Titles held in RAM at a time
+inline constexpr uint16_t WINDOW_MARGIN = 16;  // Ask for a new window when this close to the edge
+
+struct DirectoryWindow {
+    uint16_t start;  // Index of the first entry
+    uint16_t count;
+    file_info entries[WINDOW_SIZE];
+};
+
+inline DirectoryWindow directory_windows[2] = {};
+inline DirectoryWindow* volatile directory_window = &directory_windows[0];  // Read by core 1, swapped by core 0
+
+/*! \brief Get the first index of the window centred on an entry */
+__force_inline uint16_t directory_window_start(uint16_t index) {
+    uint16_t size = directory_size;
+    if (index < WINDOW_SIZE / 2 || size <= WINDOW_SIZE) {
+        return 0;
+    }
+    return min((uint16_t) (index - WINDOW_SIZE / 2), (uint16_t) (size - WINDOW_SIZE));
+}
+
+/*! \brief Fill the unused window from the index and swap it in. Must be called from core 0
+ *
+ * \param start Index of the first entry of the window
+ */
+void directory_fill_window(uint16_t start) {
+    uint32_t start_us = time_us_32();
+    DirectoryWindow* window = directory_window == &directory_windows[0] ? &directory_windows[1] : &directory_windows[0];
+    window->start = start;
+    window->count = 0;
+    if (start < directory_size && directory_index.seek(sizeof(IndexHeader) + start * sizeof(file_info))) {
+        uint16_t count = min((uint16_t) (directory_size - start), WINDOW_SIZE);
+        window->count = directory_index.read((uint8_t*) window->entries, count * sizeof(file_info)) / sizeof(file_info);
+    }
+    __dmb();
+    directory_window = window;  // Always swapped, so core 1 knows its request was handled
+
+    uint32_t elapsed = time_us_32() - start_us;
+    directory_stats.fill_us_max = max(directory_stats.fill_us_max, elapsed);
+    directory_stats.fills++;
+}
+
+/*! \brief Get an entry from the current window. Called from core 1
+ *
+ * \param index Position of the entry in the index
+ * \return The entry, or nullptr if it isn't in the window
+ */
+__force_inline const file_info* directory_entry(uint16_t index) {
+    const DirectoryWindow* window = directory_window;
+    uint16_t offset = index - window->start;
+    return offset < window->count ? &window->entries[offset] : nullptr;
+}
+
+/*! \brief Ask core 0 for a new window if an entry is close to the edge of the current one. Called from core 1
+ *
+ * \param index Position of the selected entry in the index
+ */
+__force_inline void directory_prefetch(uint16_t index) {
+    static const DirectoryWindow* requested_from = nullptr;  // Window that was current at the last request
+    const DirectoryWindow* window = directory_window;
+    if (window == requested_from) {
+        return;  // Still waiting for core 0
+    }
+    uint16_t start = directory_window_start(index);
+    uint16_t offset = index - window->start;
+    bool near_edge = offset < WINDOW_MARGIN || offset + WINDOW_MARGIN >= window->count;
+    if (start != window->start && (near_edge || offset >= window->count) && post_to_core0({MESSAGE::FILL_WINDOW, start})) {
+        requested_from = window;  // Otherwise asked again on the next call
+    }
+}
+
+// Title pages
+
+inline constexpr uint8_t PAGE_TITLES = 7;      // Titles per page, after the header
+inline constexpr uint8_t PAGE_SLOTS = 4;       // The shown page, the pages either side of it, and one to move to
+inline constexpr uint16_t PAGE_NONE = 0xFFFF;
+
+/*! \brief A page of titles, laid out as the menu reads it (multi-byte values are big endian, as on the F8) */
+struct TitlePage {
+    uint8_t ready;                 // 0 on the placeholder shown while core 0 fills the page
+    uint8_t count;                 // Titles on the page
+    uint8_t total[2];              // Entries in the index
+    uint8_t first[2];              // Index of the first title
+    uint8_t selected;              // Position of the selected entry on the page
+    uint8_t reserved[25];
+    char titles[PAGE_TITLES][32];  // Null padded
+};
+
+static_assert(sizeof(TitlePage) == 0x100, "A title page takes the place of one page of memory");
+
+struct TitlePageSlot {
+    TitlePage page;
+    volatile uint16_t number = PAGE_NONE;  // Page wanted by core 1
+    volatile uint16_t filled = PAGE_NONE;  // Page core 0 last filled it with, it's ready when they match
+};
+
+inline TitlePageSlot title_page_slots[PAGE_SLOTS];
+inline TitlePage title_page_placeholder = {};
+
+/*! \brief Fill a page slot with the page core 1 wants. Must be called from core 0
+ *
+ * \details Core 1 only gives a slot a new page number while it isn't showing
+ * it, and only shows it once `filled` matches, so a slot that is already
+ * filled is left alone. Otherwise `filled` is cleared before the page is
+ * touched, and the number is read again after, so core 1 either saw the slot
+ * as filled and asked for the page it already holds, which is then kept, or
+ * sees it as not ready until it's filled again.
+ *
+ * \param slot_index The slot
+ * \param force Fill it even if it holds the page already (e.g. the index was rebuilt)
+ */
+void title_page_fill(uint8_t slot_index, bool force = false) {
+    uint32_t start_us = time_us_32();
+    TitlePageSlot &slot = title_page_slots[slot_index];
+    uint16_t held = force ? PAGE_NONE : slot.filled;
+    if (slot.number == held) {
+        return;
+    }
+    slot.filled = PAGE_NONE;
+    __dmb();
+    uint16_t number = slot.number;
+    if (number == held || number == PAGE_NONE) {
+        slot.filled = held;
+        return;
+    }
+
+    static file_info entries[PAGE_TITLES];
+    uint16_t size = directory_size;
+    uint32_t first = number * PAGE_TITLES;
+    uint8_t count = 0;
+    if (first < size && directory_index.seek(sizeof(IndexHeader) + first * sizeof(file_info))) {
+        count = min(size - first, (uint32_t) PAGE_TITLES);
+        count = directory_index.read((uint8_t*) entries, count * sizeof(file_info)) / sizeof(file_info);
+    }
+
+    TitlePage &page = slot.page;
+    uint8_t selected = page.selected;  // Set by core 1 when it shows the page
+    memset(&page, 0, sizeof(page));
+    page.selected = force ? selected : 0;
+    page.count = count;
+    page.total[0] = size >> 8;
+    page.total[1] = size & 0xFF;
+    page.first[0] = first >> 8;
+    page.first[1] = first & 0xFF;
+    for (uint8_t i = 0; i < count; i++) {
+        memcpy(page.titles[i], entries[i].title, sizeof(page.titles[i]));
+    }
+    __dmb();
+    page.ready = 1;  // Last, as a forced fill can rewrite a page the menu is showing
+    slot.filled = number;
+
+    uint32_t elapsed = time_us_32() - start_us;
+    directory_stats.page_fill_us_max = max(directory_stats.page_fill_us_max, elapsed);
+    directory_stats.page_fills++;
+}
+
+/*! \brief Fill every slot again from the index. Must be called from core 0, after the index is rebuilt */
+void title_pages_refill() {
+    for (uint8_t i = 0; i < PAGE_SLOTS; i++) {
+        title_page_fill(i, true);
+    }
+}
+
+/*! \brief Forget every page, before the menu starts */
+void title_pages_reset() {
+    for (auto &slot : title_page_slots) {
+        slot.number = PAGE_NONE;
+        slot.filled = PAGE_NONE;
+    }
+}
+
+/*! \brief Find the first entry at or after a letter. Must be called from core 0
+ *
+ * \details A binary search of the index, in the order it was sorted in, so
+ * it takes at most 16 reads.
+ *
+ * \param letter The letter, in either case
+ * \return Position of the entry, or of the last entry if every title comes before the letter
+ */
+uint16_t directory_find_letter(char letter) {
+    const char key[2] = {letter, '\0'};
+    uint16_t size = directory_size;
+    uint16_t low = 0;
+    uint16_t high = size;
+    while (low < high) {
+        uint16_t middle = low + (high - low) / 2;
+        file_info entry;
+        if (!directory_read(middle, entry)) {
+            break;
+        }
+        if (strcasecmp(entry.title + 1, key) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < size ? low : (size != 0 ? size - 1 : 0);
+}
+
+// Signature check
+
+struct DirectoryScan {
+    File dir;
+    uint32_t signature;
+    uint32_t expected;    // Signature stored in the index
+    uint32_t start_ms;
+    bool active = false;
+};
+
+inline DirectoryScan directory_scan;
+inline constexpr uint16_t VERIFY_BATCH = 16;  // Entries checked per call of directory_verify_step()
+
+/*! \brief Start checking the index against the directory in the background */
+void directory_verify_begin(uint32_t expected) {
+    directory_scan.dir = SD.open("/");
+    directory_scan.signature = SIGNATURE_SEED;
+    directory_scan.expected = expected;
+    directory_scan.start_ms = millis();
+    directory_scan.active = directory_scan.dir;
+}
+
+/*! \brief Check the next few directory entries, and rebuild the index if it is out of date. Must be called from core 0
+ *
+ * \return true while the check is still running
+ */
+bool directory_verify_step() {
+    if (!directory_scan.active) {
+        return false;
+    }
+    for (uint16_t i = 0; i < VERIFY_BATCH; i++) {
+        File entry = directory_scan.dir.openNextFile();
+        if (!entry) {
+            directory_scan.active = false;
+            directory_scan.dir.close();
+            directory_stats.verify_ms = millis() - directory_scan.start_ms;
+            if (directory_scan.signature != directory_scan.expected) {
+                uint32_t signature;
+                if (directory_build() && directory_open_index(signature)) {
+                    directory_fill_window(directory_window_start(directory_window->start + WINDOW_SIZE / 2));  // Same place, clipped to the new size
+                } else {
+                    directory_size = 0;
+                }
+                title_pages_refill();  // Pages from the old index have titles that may have moved
+            }
+            return false;
+        }
+        if (!is_index_file(entry.name())) {
+            directory_scan.signature = signature_add(directory_scan.signature, entry);
+        }
+    }
+    return true;
+}
+
+/*! \brief Open the index, building it if needed, and fill the first window. Must be called from core 0 */
+void directory_open() {
+    uint32_t start_ms = millis();
+    uint32_t signature;
+    if (!directory_open_index(signature)) {
+        if (!directory_build() || !directory_open_index(signature)) {
+            directory_size = 0;
+        }
+        directory_scan.active = false;  // Just built, no need to check it
+    } else {
+        directory_verify_begin(signature);
+    }
+    directory_fill_window(0);
+    directory_stats.open_ms = millis() - start_ms;
+}
@@ -0,0 +1,471 @@
+/** \file flash_cache.hpp
+ *
+ * \brief Cache of recently loaded ROM files in QSPI flash
+ *
+ * \details The end of the Pico's flash holds FLASH_CACHE_SLOTS copies of ROM
+ * files: the menu (boot.bin) and the games in the recent list (RECENT_PATH).
+ * A cached file is loaded by load_rom() straight out of the memory mapped
+ * flash, so the memory map and ports are set up exactly as they would be from
+ * the SD card, just without waiting for it.
+ *
+ * - At power on, the menu is loaded from flash before the SD card is even
+ *   initialized.
+ * - A selected game whose name, size and write time match a slot is loaded from
+ *   flash, then the SD copy is hashed in the background to check the slot.
+ * - While the menu is running, flash_cache_step() goes through the menu and the
+ *   recent list, checking the content hash of every slot against the SD card,
+ *   and writes the files that are missing or out of date.
+ *
+ * Flash can only be written while the menu is running. Port handlers run from
+ * flash, so core 1 holds back port I/O while it's being written, and replays
+ * the writes afterwards (ports_suspend()). That would break a game's timing,
+ * but only delays a keypress in the menu. The cache also waits until the menu
+ * has had no input for FLASH_CACHE_IDLE_MS, so a sync doesn't run while the
+ * menu is being used. Writes stop as soon as a game is selected, and the slot
+ * header is written last, so an interrupted write leaves an empty slot. A slot
+ * found to be out of date while a game is running is ignored until it's
+ * rewritten.
+ *
+ * If boot.bin changed, the cached menu is still used until the next power on,
+ * since it's already running by the time the SD card can be checked.
+ *
+ * ### Slot layout
+ *
+ * | Offset            | Size                   | Content
+ * |-------------------|------------------------|--------
+ * | 0                 | FLASH_SECTOR_SIZE      | FlashSlotHeader
+ * | FLASH_SECTOR_SIZE | FLASH_CACHE_FILE_LIMIT | The file
+ *
+ * The cache and a settings sector below it take the last 532K of flash, so
+ * the sketch must be built without a filesystem (Tools > Flash Size > "2MB (no
+ * FS)"). Neither is used if the sketch reaches into them.
+ */
+
+#pragma once
+
+#include "config.hpp"
+#include "file_cache.hpp"
+#include "loader.hpp"
+
+#include <hardware/flash.h>
+#include <hardware/sync.h>
+
+extern "C" char __flash_binary_end;  // End of the sketch in flash, from the linker script
+
+inline constexpr uint8_t FLASH_CACHE_SLOTS = 4;              // The menu and the last 3 games
+inline constexpr uint32_t FLASH_CACHE_FILE_LIMIT = 0x20000;  // Largest file that can be cached (128K)
+inline constexpr uint32_t FLASH_CACHE_SLOT_SIZE = FLASH_SECTOR_SIZE + FLASH_CACHE_FILE_LIMIT;
+inline constexpr uint32_t FLASH_CACHE_OFFSET = PICO_FLASH_SIZE_BYTES - FLASH_CACHE_SLOTS * FLASH_CACHE_SLOT_SIZE;
+inline constexpr uint32_t FLASH_CACHE_MAGIC = 0x43435650;    // "PVCC"
+inline constexpr uint8_t FLASH_CACHE_NAME_SIZE = 96;         // Longer names aren't cached
+inline constexpr char BOOT_NAME[] = "boot.bin";
+inline constexpr char RECENT_PATH[] = "/.pvcrecent";
+inline constexpr uint32_t FLASH_CACHE_IDLE_MS = 1000;       // Time without menu input before flash is written
+
+static_assert(FLASH_CACHE_OFFSET % FLASH_SECTOR_SIZE == 0, "Cache slots must be sector aligned");
+
+struct FlashSlotHeader {
+    uint32_t magic;
+    uint32_t sequence;      // Order the slots were written in, the oldest is replaced first
+    uint64_t content_hash;  // Hash of the whole file
+    uint32_t size;
+    uint32_t last_write;    // Write time of the SD copy
+    char name[FLASH_CACHE_NAME_SIZE];
+    uint64_t check;         // Hash of the fields above
+};
+
+static_assert(sizeof(FlashSlotHeader) <= FLASH_PAGE_SIZE, "The slot header must fit in a flash page");
+
+struct FlashCacheStats {
+    bool boot_from_cache;
+    uint32_t boot_ready_us;   // Time from power on to the menu being loaded
+    uint32_t first_fetch_us;  // Time from power on to the first fetch from the Videocart (SERIAL_DIAGNOSTICS only)
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writes;
+    uint32_t stale;           // Slots that didn't match the SD card
+};
+
+inline FlashCacheStats flash_cache_stats = {};
+inline bool menu_running = false;       // boot.bin is the running program, so flash can be written
+inline uint8_t flash_cache_stale = 0;   // Bit per slot found to be out of date while a game was running
+
+// Hashing (64-bit FNV-1a)
+
+inline constexpr uint64_t HASH_SEED = 14695981039346656037ull;
+
+uint64_t hash_bytes(uint64_t hash, const void* data, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*) data;
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Slots
+
+/*! \brief Check that flash from an offset to the end isn't used by the sketch */
+bool flash_free_from(uint32_t offset) {
+    return (uintptr_t) &__flash_binary_end <= XIP_BASE + offset;
+}
+
+/*! \brief Check that the cache is enabled and doesn't overlap the sketch */
+bool flash_cache_available() {
+    return FLASH_CACHE && flash_free_from(FLASH_CACHE_OFFSET);
+}
+
+__force_inline uint32_t flash_slot_offset(uint8_t slot) {
+    return FLASH_CACHE_OFFSET + slot * FLASH_CACHE_SLOT_SIZE;
+}
+
+__force_inline const FlashSlotHeader &flash_slot(uint8_t slot) {
+    return *(const FlashSlotHeader*) (XIP_BASE + flash_slot_offset(slot));
+}
+
+__force_inline const uint8_t* flash_slot_data(uint8_t slot) {
+    return (const uint8_t*) (XIP_BASE + flash_slot_offset(slot) + FLASH_SECTOR_SIZE);
+}
+
+bool flash_slot_valid(uint8_t slot) {
+    const FlashSlotHeader &header = flash_slot(slot);
+    return header.magic == FLASH_CACHE_MAGIC && header.size <= FLASH_CACHE_FILE_LIMIT
+           && header.check == hash_bytes(HASH_SEED, &header, offsetof(FlashSlotHeader, check))
+           && !(flash_cache_stale & (1 << slot));
+}
+
+/*! \brief Find the newest slot holding a file name
+ *
+ * \param name The file name, without a path
+ * \return The slot, or -1 if the file isn't cached
+ */
+int8_t flash_cache_find(const char* name) {
+    int8_t found = -1;
+    for (uint8_t slot = 0; slot < FLASH_CACHE_SLOTS && flash_cache_available(); slot++) {
+        if (flash_slot_valid(slot) && strncmp(flash_slot(slot).name, name, FLASH_CACHE_NAME_SIZE) == 0
+            && (found < 0 || flash_slot(slot).sequence > flash_slot(found).sequence)) {
+            found = slot;
+        }
+    }
+    return found;
+}
+
+/*! \brief Find the slot holding the current version of a file
+ *
+ * \param file The SD copy
+ * \return The slot, or -1 if there is none with the same name, size and write time
+ */
+int8_t flash_cache_find(File &file) {
+    int8_t slot = flash_cache_find(file.name());
+    if (slot >= 0 && (flash_slot(slot).size != file.size() || flash_slot(slot).last_write != (uint32_t) file.getLastWrite())) {
+        return -1;
+    }
+    return slot;
+}
+
+/*! \brief Replace the current program with a cached file
+ *
+ * \return false if the file is invalid
+ */
+bool flash_cache_load(uint8_t slot) {
+    LoadStream stream(flash_slot_data(slot), flash_slot(slot).size);
+    return load_rom(stream);
+}
+
+// Writing
+
+/*! \brief Erase or program flash, with port I/O suspended. Must be called from core 0
+ *
+ * \param offset Offset from the start of flash
+ * \param data The data to program, or nullptr to erase
+ * \param size A multiple of FLASH_SECTOR_SIZE to erase, or of FLASH_PAGE_SIZE to program
+ */
+void flash_cache_flash(uint32_t offset, const uint8_t* data, size_t size) {
+    ports_suspend(true);  // Returns once core 1 is out of any port handler
+    uint32_t interrupts = save_and_disable_interrupts();
+    if (data == nullptr) {
+        flash_range_erase(offset, size);
+    } else {
+        flash_range_program(offset, data, size);
+    }
+    restore_interrupts(interrupts);
+    ports_suspend(false);
+}
+
+/*! \brief Pick the slot to write a file to
+ *
+ * \details The old copy of the same file if there is one, otherwise an empty
+ * slot, otherwise the oldest slot other than the menu's.
+ */
+uint8_t flash_cache_choose_slot(const char* name) {
+    int8_t same = flash_cache_find(name);
+    if (same >= 0) {
+        return same;
+    }
+    uint8_t oldest = 0;
+    uint32_t oldest_sequence = UINT32_MAX;
+    for (uint8_t slot = 0; slot < FLASH_CACHE_SLOTS; slot++) {
+        if (!flash_slot_valid(slot)) {
+            return slot;
+        }
+        if (strncmp(flash_slot(slot).name, BOOT_NAME, FLASH_CACHE_NAME_SIZE) != 0 && flash_slot(slot).sequence < oldest_sequence) {
+            oldest = slot;
+            oldest_sequence = flash_slot(slot).sequence;
+        }
+    }
+    return oldest;
+}
+
+uint32_t flash_cache_next_sequence() {
+    uint32_t sequence = 0;
+    for (uint8_t slot = 0; slot < FLASH_CACHE_SLOTS; slot++) {
+        if (flash_slot_valid(slot)) {
+            sequence = max(sequence, flash_slot(slot).sequence + 1);
+        }
+    }
+    return sequence;
+}
+
+// Settings
+
+inline constexpr uint32_t FLASH_SETTINGS_OFFSET = FLASH_CACHE_OFFSET - FLASH_SECTOR_SIZE;
+inline constexpr uint32_t FLASH_SETTINGS_MAGIC = 0x53435650;  // "PVCS"
+
+/*! \brief Settings kept in flash between power cycles
+ *
+ * \details Stored in the sector below the cache, whether the cache is enabled
+ * or not. They're only written when a value changes, and like the cache, only
+ * while the menu is running.
+ */
+struct FlashSettings {
+    uint32_t magic;
+    uint32_t sd_speed_hz;  // SPI clock the SD card last worked at, 0 if unknown
+    uint64_t check;        // Hash of the fields above
+};
+
+/*! \brief Get the stored settings, or the defaults if there are none */
+FlashSettings flash_settings() {
+    const FlashSettings &stored = *(const FlashSettings*) (XIP_BASE + FLASH_SETTINGS_OFFSET);
+    if (flash_free_from(FLASH_SETTINGS_OFFSET) && stored.magic == FLASH_SETTINGS_MAGIC
+        && stored.check == hash_bytes(HASH_SEED, &stored, offsetof(FlashSettings, check))) {
+        return stored;
+    }
+    return {FLASH_SETTINGS_MAGIC, 0, 0};
+}
+
+/*! \brief Store the settings if they changed. Must be called from core 0
+ *
+ * \return true if they were written
+ */
+bool flash_settings_save(FlashSettings settings) {
+    FlashSettings stored = flash_settings();
+    if (!menu_running || !flash_free_from(FLASH_SETTINGS_OFFSET) || settings.sd_speed_hz == stored.sd_speed_hz) {
+        return false;
+    }
+    static uint8_t page[FLASH_PAGE_SIZE];
+    settings.magic = FLASH_SETTINGS_MAGIC;
+    settings.check = hash_bytes(HASH_SEED, &settings, offsetof(FlashSettings, check));
+    memset(page, 0xFF, sizeof(page));
+    memcpy(page, &settings, sizeof(settings));
+    flash_cache_flash(FLASH_SETTINGS_OFFSET, nullptr, FLASH_SECTOR_SIZE);
+    flash_cache_flash(FLASH_SETTINGS_OFFSET, page, sizeof(page));
+    return true;
+}
+
+// Background tasks
+
+namespace CACHE_TASK {
+    inline constexpr uint8_t NONE = 0;
+    inline constexpr uint8_t VERIFY = 1;  // Hash the SD copy and compare it to the slot
+    inline constexpr uint8_t WRITE = 2;   // Copy the SD copy into the slot
+}
+
+struct FlashCacheTask {
+    File file;
+    uint8_t mode = CACHE_TASK::NONE;
+    uint8_t slot;
+    uint32_t position;
+    uint64_t hash;
+};
+
+inline FlashCacheTask cache_task;
+inline char cache_queue[FLASH_CACHE_SLOTS][FLASH_CACHE_NAME_SIZE];  // Files to check while the menu is running
+inline uint8_t cache_queue_length = 0;
+inline uint8_t cache_queue_next = 0;
+alignas(4) inline uint8_t cache_buffer[FLASH_SECTOR_SIZE];
+
+/*! \brief Start hashing or copying a file
+ *
+ * \param file The SD copy, which the task takes over
+ * \param slot The slot to check or write
+ * \param mode CACHE_TASK::VERIFY or CACHE_TASK::WRITE
+ */
+void flash_cache_task_begin(File &file, uint8_t slot, uint8_t mode) {
+    if (&file != &cache_task.file) {
+        cache_task.file.close();
+        cache_task.file = file;
+    }
+    cache_task.file.seek(0, SeekSet);
+    cache_task.mode = mode;
+    cache_task.slot = slot;
+    cache_task.position = 0;
+    cache_task.hash = HASH_SEED;
+    if (mode == CACHE_TASK::WRITE) {
+        flash_cache_flash(flash_slot_offset(slot), nullptr, FLASH_SECTOR_SIZE); // Invalidate the slot first
+    }
+}
+
+/*! \brief Start checking a cached file that was just loaded from flash */
+void flash_cache_verify_begin(File &file, uint8_t slot) {
+    flash_cache_task_begin(file, slot, CACHE_TASK::VERIFY);
+}
+
+/*! \brief Start checking the next queued file, if the menu is still running
+ *
+ * \return false if there are no files left
+ */
+bool flash_cache_next_file() {
+    while (menu_running && cache_queue_next < cache_queue_length) {
+        char path[FLASH_CACHE_NAME_SIZE + 1] = "/";
+        strncpy(path + 1, cache_queue[cache_queue_next++], FLASH_CACHE_NAME_SIZE - 1);
+        File file = SD.open(path, FILE_READ);
+        if (!file || file.isDirectory() || file.size() > FLASH_CACHE_FILE_LIMIT) {
+            continue;
+        }
+        int8_t slot = flash_cache_find(file);
+        if (slot >= 0) {
+            flash_cache_task_begin(file, slot, CACHE_TASK::VERIFY);
+        } else {
+            flash_cache_task_begin(file, flash_cache_choose_slot(file.name()), CACHE_TASK::WRITE);
+        }
+        return true;
+    }
+    return false;
+}
+
+/*! \brief Write the header that makes a slot valid */
+void flash_cache_write_header() {
+    static uint8_t page[FLASH_PAGE_SIZE];
+    FlashSlotHeader header = {};
+    header.magic = FLASH_CACHE_MAGIC;
+    header.sequence = flash_cache_next_sequence();
+    header.content_hash = cache_task.hash;
+    header.size = cache_task.position;
+    header.last_write = cache_task.file.getLastWrite();
+    strncpy(header.name, cache_task.file.name(), FLASH_CACHE_NAME_SIZE - 1);
+    header.check = hash_bytes(HASH_SEED, &header, offsetof(FlashSlotHeader, check));
+    memset(page, 0xFF, sizeof(page));
+    memcpy(page, &header, sizeof(header));
+    flash_cache_flash(flash_slot_offset(cache_task.slot), page, sizeof(page));
+    flash_cache_stale &= ~(1 << cache_task.slot);
+}
+
+/*! \brief Check the menu hasn't had any input for FLASH_CACHE_IDLE_MS. Must be called from core 0 */
+bool flash_cache_menu_idle() {
+    static uint32_t commands = 0;
+    static uint32_t last_ms = 0;
+    if (Launcher::commands != commands) {
+        commands = Launcher::commands;
+        last_ms = millis();
+    }
+    return millis() - last_ms >= FLASH_CACHE_IDLE_MS;
+}
+
+/*! \brief Hash or copy the next sector of the current file. Must be called from core 0
+ *
+ * \return true while there is work left, false while there's none or the menu is in use
+ */
+bool flash_cache_step() {
+    if (!flash_cache_menu_idle()) {
+        return false;
+    }
+    FlashCacheTask &task = cache_task;
+    if (task.mode == CACHE_TASK::NONE) {
+        return flash_cache_next_file();
+    }
+    if (task.mode == CACHE_TASK::WRITE && !menu_running) { // A game was selected, leave the slot empty
+        task.file.close();
+        task.mode = CACHE_TASK::NONE;
+        return false;
+    }
+
+    uint32_t length = task.file.read(cache_buffer, FLASH_SECTOR_SIZE);
+    task.hash = hash_bytes(task.hash, cache_buffer, length);
+    if (task.mode == CACHE_TASK::WRITE && length > 0) {
+        memset(cache_buffer + length, 0xFF, FLASH_SECTOR_SIZE - length);
+        uint32_t offset = flash_slot_offset(task.slot) + FLASH_SECTOR_SIZE + task.position;
+        flash_cache_flash(offset, nullptr, FLASH_SECTOR_SIZE);
+        flash_cache_flash(offset, cache_buffer, FLASH_SECTOR_SIZE);
+    }
+    task.position += length;
+    if (length == FLASH_SECTOR_SIZE) {
+        return true;
+    }
+
+    // End of the file
+    if (task.mode == CACHE_TASK::VERIFY && task.hash != flash_slot(task.slot).content_hash) {
+        flash_cache_stats.stale++;
+        if (menu_running) {
+            flash_cache_task_begin(task.file, task.slot, CACHE_TASK::WRITE);
+            return true;
+        }
+        flash_cache_stale |= 1 << task.slot;
+    } else if (task.mode == CACHE_TASK::WRITE && task.position == task.file.size()) {
+        flash_cache_write_header();
+        flash_cache_stats.writes++;
+    }
+    task.file.close();
+    task.mode = CACHE_TASK::NONE;
+    return true;
+}
+
+// Recent list
+
+/*! \brief Read the recent list
+ *
+ * \param names Where to store the names, most recent first
+ * \return The number of names
+ */
+uint8_t flash_cache_read_recent(char (&names)[FLASH_CACHE_SLOTS - 1][FLASH_CACHE_NAME_SIZE]) {
+    File file = SD.open(RECENT_PATH, FILE_READ);
+    if (!file) {
+        return 0;
+    }
+    uint8_t count = file.read((uint8_t*) names, sizeof(names)) / FLASH_CACHE_NAME_SIZE;
+    for (uint8_t i = 0; i < count; i++) {
+        names[i][FLASH_CACHE_NAME_SIZE - 1] = '\0';
+    }
+    return count;
+}
+
+/*! \brief Put a file at the front of the recent list. Must be called from core 0 */
+void flash_cache_add_recent(const char* name) {
+    if (!flash_cache_available() || strlen(name) >= FLASH_CACHE_NAME_SIZE) {
+        return;
+    }
+    char names[FLASH_CACHE_SLOTS - 1][FLASH_CACHE_NAME_SIZE];
+    uint8_t count = flash_cache_read_recent(names);
+    char updated[FLASH_CACHE_SLOTS - 1][FLASH_CACHE_NAME_SIZE] = {};
+    strncpy(updated[0], name, FLASH_CACHE_NAME_SIZE - 1);
+    uint8_t updated_count = 1;
+    for (uint8_t i = 0; i < count && updated_count < FLASH_CACHE_SLOTS - 1; i++) {
+        if (strcmp(names[i], name) != 0) {
+            memcpy(updated[updated_count++], names[i], FLASH_CACHE_NAME_SIZE);
+        }
+    }
+    File file = create_file(RECENT_PATH);
+    file.write((uint8_t*) updated, updated_count * FLASH_CACHE_NAME_SIZE);
+    file.close();
+}
+
+/*! \brief Queue the menu and the recent list to be checked while the menu runs. Must be called from core 0 */
+void flash_cache_sync_begin() {
+    if (!flash_cache_available()) {
+        return;
+    }
+    char names[FLASH_CACHE_SLOTS - 1][FLASH_CACHE_NAME_SIZE];
+    uint8_t count = flash_cache_read_recent(names);
+    strncpy(cache_queue[0], BOOT_NAME, FLASH_CACHE_NAME_SIZE);
+    memcpy(cache_queue[1], names, count * FLASH_CACHE_NAME_SIZE);
+    cache_queue_length = count + 1;
+    cache_queue_next = 0;
+}
@@ -0,0 +1,174 @@
+/** \file fram.hpp
+ *
+ * \brief FRAM driver and NVRAM persistence
+ *
+ * \details The board has an SPI FRAM sharing the SD card's bus, selected by
+ * FRAM_CHIP_SELECT_PIN. NVRAM_CT regions are mirrored in program_rom, which is
+ * all the CPU ever sees, so the bus never waits on SPI:
+ *
+ * 1. load_game() fills the mirror from FRAM (nvram_load())
+ * 2. Core 1 updates the mirror and queues each write in nvram_writes
+ * 3. Core 0 drains the queue to FRAM (nvram_flush()), merging writes to
+ *    consecutive addresses into one SPI transfer
+ *
+ * FRAM is addressed by the low bits of the CPU address, so games that use the
+ * same NVRAM addresses share the same FRAM. To keep one game's save from being
+ * loaded into another, the last FRAM_TAG_SIZE bytes of FRAM hold a FramTag
+ * naming the game the data belongs to (a hash of its CHF header and title, see
+ * read_chf_file()). nvram_load() only reads FRAM when the tag matches the game
+ * being loaded. Otherwise the game keeps the initial contents from its CHF
+ * file, which are written through to FRAM, followed by its tag. NVRAM
+ * addresses that fall on the tag aren't kept.
+ */
+
+#pragma once
+
+#include "chips.hpp"
+#include "gpio.hpp"
+
+#include <SPI.h>
+
+inline constexpr uint32_t FRAM_SIZE = 0x8000;      // 32K, two address bytes
+inline constexpr uint32_t FRAM_SPI_HZ = 20000000;
+inline constexpr uint8_t NVRAM_BATCH_SIZE = 64;    // Longest run of consecutive writes sent at once
+inline constexpr uint32_t FRAM_TAG_SIZE = 0x10;
+inline constexpr uint16_t FRAM_TAG_ADDRESS = FRAM_SIZE - FRAM_TAG_SIZE;  // NVRAM is kept below this
+inline constexpr uint32_t FRAM_TAG_MAGIC = 0x54465650;  // "PVFT"
+
+struct FramTag {
+    uint32_t magic;
+    uint32_t game;   // Tag of the game the data belongs to
+    uint32_t check;  // ~game, so a blank or worn FRAM doesn't match
+};
+
+static_assert(sizeof(FramTag) <= FRAM_TAG_SIZE, "The tag must fit in its space");
+
+inline uint32_t nvram_game = 0;          // Tag of the game being loaded
+inline bool nvram_fram_matches = false;  // FRAM holds nvram_game's data
+
+namespace FRAM_OP {
+    inline constexpr uint8_t WREN = 0x06;   // Set write enable latch
+    inline constexpr uint8_t WRITE = 0x02;  // Write memory data
+    inline constexpr uint8_t READ = 0x03;   // Read memory data
+}
+
+/*! \brief Select the FRAM and send an opcode with an address
+ *
+ * \param opcode FRAM_OP::READ or FRAM_OP::WRITE
+ * \param address The FRAM address
+ */
+void fram_begin(uint8_t opcode, uint16_t address) {
+    SPI.beginTransaction(SPISettings(FRAM_SPI_HZ, MSBFIRST, SPI_MODE0));
+    gpio_put(FRAM_CHIP_SELECT_PIN, false);
+    SPI.transfer(opcode);
+    SPI.transfer(address >> 8);
+    SPI.transfer(address & 0xFF);
+}
+
+/*! \brief Deselect the FRAM */
+void fram_end() {
+    gpio_put(FRAM_CHIP_SELECT_PIN, true);
+    SPI.endTransaction();
+}
+
+/*! \brief Read from FRAM
+ *
+ * \param address The FRAM address, must not wrap past FRAM_SIZE
+ * \param buffer Where to put the data
+ * \param length The number of bytes to read
+ */
+void fram_read(uint16_t address, uint8_t* buffer, size_t length) {
+    memset(buffer, 0xFF, length);
+    fram_begin(FRAM_OP::READ, address);
+    SPI.transfer(buffer, length);
+    fram_end();
+}
+
+/*! \brief Write to FRAM
+ *
+ * \param address The FRAM address, must not wrap past FRAM_SIZE
+ * \param buffer The data to write
+ * \param length The number of bytes to write
+ */
+void fram_write(uint16_t address, const uint8_t* buffer, size_t length) {
+    SPI.beginTransaction(SPISettings(FRAM_SPI_HZ, MSBFIRST, SPI_MODE0));
+    gpio_put(FRAM_CHIP_SELECT_PIN, false);
+    SPI.transfer(FRAM_OP::WREN);
+    gpio_put(FRAM_CHIP_SELECT_PIN, true);
+    SPI.endTransaction();
+
+    fram_begin(FRAM_OP::WRITE, address);
+    SPI.transfer(buffer, nullptr, length);
+    fram_end();
+}
+
+/*! \brief Check whose data FRAM holds, before a game's NVRAM regions are loaded
+ *
+ * \param game The tag of the game being loaded
+ */
+void nvram_begin(uint32_t game) {
+    FramTag tag;
+    fram_read(FRAM_TAG_ADDRESS, (uint8_t*) &tag, sizeof(tag));
+    nvram_game = game;
+    nvram_fram_matches = tag.magic == FRAM_TAG_MAGIC && tag.game == game && tag.check == ~game;
+}
+
+/*! \brief Fill the mirror of an NVRAM region from FRAM, or FRAM from the mirror if it holds another game's data
+ *
+ * \param address The first CPU address of the region
+ * \param size The size of the region
+ */
+void nvram_load(uint16_t address, uint32_t size) {
+    size = min(size, (uint32_t) 0x10000 - address);
+    while (size > 0) {
+        uint16_t fram_address = address & (FRAM_SIZE - 1);
+        uint32_t length = min(size, FRAM_SIZE - fram_address);
+        if (fram_address < FRAM_TAG_ADDRESS) {
+            length = min(length, (uint32_t) (FRAM_TAG_ADDRESS - fram_address));
+            if (nvram_fram_matches) {
+                fram_read(fram_address, program_rom + address, length);
+            } else {
+                fram_write(fram_address, program_rom + address, length);
+            }
+        }
+        address += length;
+        size -= length;
+    }
+    if (!nvram_fram_matches) {
+        FramTag tag = {FRAM_TAG_MAGIC, nvram_game, ~nvram_game};  // Written after the data it vouches for
+        fram_write(FRAM_TAG_ADDRESS, (const uint8_t*) &tag, sizeof(tag));
+    }
+}
+
+/*! \brief Write all queued NVRAM writes to FRAM. Must be called from core 0 */
+void nvram_flush() {
+    uint8_t run[NVRAM_BATCH_SIZE];
+    uint16_t run_start = 0;
+    uint8_t run_length = 0;
+
+    NvramWrite write;
+    while (nvram_writes.pop(write)) {
+        if ((write.address & (FRAM_SIZE - 1)) >= FRAM_TAG_ADDRESS) {
+            continue;  // Would overwrite the tag
+        }
+        uint16_t offset = write.address - run_start;
+        if (run_length > 0 && offset < run_length) {  // Overwrite within the run
+            run[offset] = write.data;
+            continue;
+        }
+        bool wraps = (write.address & (FRAM_SIZE - 1)) == 0;
+        if (run_length > 0 && offset == run_length && run_length < NVRAM_BATCH_SIZE && !wraps) {  // Extend the run
+            run[run_length++] = write.data;
+            continue;
+        }
+        if (run_length > 0) {
+            fram_write(run_start & (FRAM_SIZE - 1), run, run_length);
+        }
+        run_start = write.address;
+        run[0] = write.data;
+        run_length = 1;
+    }
+    if (run_length > 0) {
+        fram_write(run_start & (FRAM_SIZE - 1), run, run_length);
+    }
+}
@@ -51,6 +51,8 @@
 
 #pragma once
 
+#include "config.hpp"
+
 // Core 1 pins
 inline constexpr uint8_t WRITE_PIN = 17;
 inline constexpr uint8_t PHI_PIN = 26;
@@ -61,9 +63,28 @@ inline constexpr uint8_t DBUS_OUT_CE_PIN = 14;
 
 // Core 1 variables
 extern uint8_t dbus;                                     // Written to by write_dbus
+inline uint32_t bus_response;                            // Handed to the PIO front end at the end of each cycle
+inline constexpr uint32_t BUS_RESPONSE_DRIVE = 0x100;    // Set in bus_response if dbus should be driven
 inline constexpr uint16_t VIDEOCART_START_ADDR = 0x800;  // Videocart address space: [0x0800 - 0x10000)
 inline constexpr uint16_t VIDEOCART_SIZE = 0xF800;       // 62K
 
+static_assert(VIDEOCART_START_ADDR % 0x100 == 0 && VIDEOCART_SIZE % 0x100 == 0, "Videocart address space must be page aligned");
+
+/*! \brief Which 256-byte pages of the address space belong to the Videocart */
+struct OwnershipMap {
+    bool page[256];
+};
+
+constexpr OwnershipMap make_ownership_map() {
+    OwnershipMap map = {};
+    for (uint32_t i = VIDEOCART_START_ADDR >> 8; i < (VIDEOCART_START_ADDR + VIDEOCART_SIZE) >> 8; i++) {
+        map.page[i] = true;
+    }
+    return map;
+}
+
+inline OwnershipMap address_owner = make_ownership_map(); // Built at compile time, kept in SRAM
+
 // Core 1 functions
 
 /*! \brief Initialize a GPIO pin in input mode
@@ -94,19 +115,40 @@ __force_inline uint8_t read_dbus() {
     return (gpio_get_all() >> DBUS0_PIN) & 0xFF;
 }
 
+/*! \brief Check if an address is within the Videocart address space
+ *
+ * \param address The address to check
+ * \return true if the Videocart responds to the address
+ */
+__force_inline bool is_cart_address(uint16_t address) {
+    return address_owner.page[address >> 8];
+}
+
+/*! \brief Put a value on the data bus, regardless of the address
+ *
+ * \param value The byte to write
+ */
+__force_inline void drive_dbus(uint8_t value) {
+    dbus = value;
+    if constexpr (PIO_BUS_FRONTEND) {
+        bus_response = BUS_RESPONSE_DRIVE | value;   // The PIO drives the bus
+        return;
+    }
+    gpio_put(DBUS_IN_CE_PIN, true);              // Disable input buffer
+    gpio_clr_mask(0xFF << DBUS0_PIN);            // Write to DBUS
+    gpio_set_mask(dbus << DBUS0_PIN);
+    gpio_set_dir_out_masked(0xFF << DBUS0_PIN);  // Set DBUS to output mode
+    gpio_put(DBUS_OUT_CE_PIN, false);            // Enable output buffer
+}
+
 /*! \brief Put a value on the data bus
  * 
  * \param value The byte to write
  * \param addr_source The address being targeted
  */
 __force_inline void write_dbus(uint8_t value, uint16_t addr_source) {
-    if (addr_source >= VIDEOCART_START_ADDR && addr_source < (VIDEOCART_START_ADDR + VIDEOCART_SIZE)) { //FIXME: assume flashcart takes full address space
-        dbus = value;
-        gpio_put(DBUS_IN_CE_PIN, true);              // Disable input buffer
-        gpio_clr_mask(0xFF << DBUS0_PIN);            // Write to DBUS
-        gpio_set_mask(dbus << DBUS0_PIN);
-        gpio_set_dir_out_masked(0xFF << DBUS0_PIN);  // Set DBUS to output mode
-        gpio_put(DBUS_OUT_CE_PIN, false);            // Enable output buffer
+    if (is_cart_address(addr_source)) { //FIXME: assume flashcart takes full address space
+        drive_dbus(value);
     }
 }
 
@@ -118,5 +160,9 @@ inline constexpr uint8_t SD_CARD_CHIP_SELECT_PIN = 5;
 inline constexpr uint8_t FRAM_CHIP_SELECT_PIN = 1;
 inline constexpr uint8_t WRITE_PROTECT_PIN = 4;
 
+// Interrupt pins (see smi.hpp)
+inline constexpr uint8_t INTRQ_PIN = 16;         // To the CPU, active low
+inline constexpr uint8_t EXTERNAL_INT_PIN = 28;  // From the Videocart connector, active low
+
 // Core 0 variables
 bool old_write_protect = gpio_get(WRITE_PROTECT_PIN); // FIXME: change to bool old_write_protect = false;
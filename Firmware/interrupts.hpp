@@ -0,0 +1,142 @@
+/** \file interrupts.hpp
+ *
+ * \brief Interrupt requests to the CPU, shared by the 3853 SMI and the MK3870
+ *
+ * \details Each interrupt source has a request, set on core 0 when its timer
+ * expires or EXTERNAL_INT_PIN changes, and cleared on core 1 when the CPU
+ * acknowledges it. INTRQ is pulled low while any request is set.
+ *
+ * Both cores write the requests and INTRQ, so each checks again after its own
+ * writes: interrupt_request() drops a request the device disabled meanwhile,
+ * and interrupt_update_intrq() pulls INTRQ low again if core 0 made a request
+ * while it was being released.
+ *
+ * The CPU acknowledges with ROMC 0x0F and 0x13, in which the highest priority
+ * source puts the low and then the high byte of its vector on the bus. Sources
+ * are listed in priority order.
+ */
+
+#pragma once
+
+#include "gpio.hpp"
+
+namespace INTERRUPT {
+    inline constexpr uint8_t SMI_TIMER = 0;
+    inline constexpr uint8_t SMI_EXTERNAL = 1;
+    inline constexpr uint8_t MK3870_TIMER = 2;
+    inline constexpr uint8_t MK3870_EXTERNAL = 3;
+    inline constexpr uint8_t COUNT = 4;
+}
+
+struct InterruptSource {
+    volatile bool request;   // Set by core 0, cleared by core 1
+    volatile bool enabled;   // Written by the device's ports
+    uint32_t external_edges; // GPIO_IRQ_EDGE_* of EXTERNAL_INT_PIN that request it, 0 for timers
+    uint16_t vector;
+    uint32_t count;          // Requests made
+};
+
+inline InterruptSource interrupt_sources[INTERRUPT::COUNT] = {};
+inline int8_t interrupt_acknowledged = -1;  // Source that answered ROMC 0x0F
+
+/*! \brief Check for a request from any source
+ *
+ * \return true if a source is requesting
+ */
+__force_inline bool interrupt_any_request() {
+    bool request = false;
+    for (auto &source : interrupt_sources) {
+        request |= source.request;
+    }
+    return request;
+}
+
+/*! \brief Pull INTRQ low while any source is requesting */
+__force_inline void interrupt_update_intrq() {
+    if (interrupt_any_request()) {
+        gpio_set_dir(INTRQ_PIN, true); // Open drain: the output is always 0
+        return;
+    }
+    gpio_set_dir(INTRQ_PIN, false);
+    __dmb();
+    if (interrupt_any_request()) {
+        gpio_set_dir(INTRQ_PIN, true); // Requested by the other core after the check
+    }
+}
+
+/*! \brief Request an interrupt, if the source is enabled. Must be called from core 0 */
+void interrupt_request(uint8_t source) {
+    if (interrupt_sources[source].enabled) {
+        interrupt_sources[source].request = true;
+        interrupt_sources[source].count++;
+        gpio_set_dir(INTRQ_PIN, true);
+        __dmb();
+        if (!interrupt_sources[source].enabled) {
+            interrupt_sources[source].request = false; // Disabled by core 1 after the check
+            interrupt_update_intrq();
+        }
+    }
+}
+
+/*! \brief Enable or disable a source. Disabling drops its request */
+__force_inline void interrupt_enable(uint8_t source, bool enabled) {
+    interrupt_sources[source].enabled = enabled;
+    if (!enabled) {
+        __dmb();
+        interrupt_sources[source].request = false;
+        interrupt_update_intrq();
+    }
+}
+
+/*! \brief EXTERNAL_INT_PIN changed. Runs on core 0 */
+void interrupt_external_irq(uint gpio, uint32_t events) {
+    for (uint8_t source = 0; source < INTERRUPT::COUNT; source++) {
+        if (interrupt_sources[source].external_edges & events) {
+            interrupt_request(source);
+        }
+    }
+}
+
+/*! \brief Set up INTRQ_PIN and EXTERNAL_INT_PIN. Must be called from core 0, which then handles the pin's interrupts */
+void interrupts_init() {
+    gpio_init(INTRQ_PIN);
+    gpio_put(INTRQ_PIN, false);
+    gpio_set_dir(INTRQ_PIN, GPIO_IN);
+    gpio_init(EXTERNAL_INT_PIN);
+    gpio_set_dir(EXTERNAL_INT_PIN, GPIO_IN);
+    gpio_pull_up(EXTERNAL_INT_PIN);
+    gpio_set_irq_enabled_with_callback(EXTERNAL_INT_PIN, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true, interrupt_external_irq);
+}
+
+/*! \brief Disable every source and drop their requests, for the next game */
+void interrupts_reset() {
+    for (auto &source : interrupt_sources) {
+        source.enabled = false;
+        source.request = false;
+    }
+    interrupt_acknowledged = -1;
+    interrupt_update_intrq();
+}
+
+/*! \brief ROMC 0x0F: put the low byte of the vector on the bus, if there's a request */
+__force_inline void interrupt_acknowledge_low() {
+    interrupt_acknowledged = -1;
+    for (uint8_t source = 0; source < INTERRUPT::COUNT; source++) {
+        if (interrupt_sources[source].request) {
+            interrupt_acknowledged = source;
+            drive_dbus(interrupt_sources[source].vector & 0xFF);
+            return;
+        }
+    }
+}
+
+/*! \brief ROMC 0x13: put the high byte of the vector on the bus, and clear the request */
+__force_inline void interrupt_acknowledge_high() {
+    if (interrupt_acknowledged >= 0) {
+        InterruptSource &source = interrupt_sources[interrupt_acknowledged];
+        drive_dbus(source.vector >> 8);
+        source.request = false;
+        interrupt_acknowledged = -1;
+        interrupt_update_intrq();
+    }
+}
@@ -0,0 +1,115 @@
+/** \file latency.hpp
+ *
+ * \brief Histograms of how long core 1 takes to respond to each bus cycle
+ *
+ * \details With BUS_LATENCY set in config.hpp, loop1() reads the SysTick
+ * counter (see timing.hpp) when it sees the rising edge of WRITE, and again once
+ * execute_romc() has driven the data bus, and latency_record() adds the time
+ * between them to the histogram of that ROMC code. Bins are
+ * 2^LATENCY_BIN_SHIFT cycles wide, so no division is needed, and the last bin
+ * holds everything longer. With PIO_BUS_FRONTEND, the time runs from core 1
+ * getting the sample to it pushing the response, so it leaves out the time the
+ * sample waited in the FIFO.
+ *
+ * A response that takes longer than LATENCY_LIMIT_NS is an overrun. These are
+ * counted, and the first one is kept so it can be looked up in a trace (see
+ * trace.hpp).
+ *
+ * Core 0 reads the histograms while core 1 is still adding to them, so a
+ * report may be a few cycles out of date. latency_percentile() works out
+ * percentiles from the histogram, to the upper edge of a bin.
+ */
+
+#pragma once
+
+#include "config.hpp"
+#include "romc.hpp"
+#include "timing.hpp"
+
+inline constexpr uint8_t LATENCY_BINS = 32;
+inline constexpr uint8_t LATENCY_BIN_SHIFT = 5;  // 32 cycles per bin, 80 ns at 400 MHz
+inline constexpr uint32_t LATENCY_LIMIT_NS = 1100;  // About half a short bus cycle, while WRITE is high
+inline constexpr uint32_t LATENCY_LIMIT_CYCLES = LATENCY_LIMIT_NS * (uint64_t) SYS_CLOCK_KHZ / 1000000;
+
+struct RomcLatency {
+    uint32_t min = UINT32_MAX;  // Cycles
+    uint32_t max = 0;
+    uint32_t count = 0;
+    uint32_t overruns = 0;
+    uint32_t bins[LATENCY_BINS] = {};
+};
+
+struct LatencyOverrun {
+    uint32_t cycles;  // 0 if there hasn't been one
+    uint8_t romc;
+    uint16_t pc0;     // After the cycle was executed
+    uint32_t time_us;
+};
+
+inline RomcLatency romc_latency[32];
+inline LatencyOverrun first_overrun = {};
+inline volatile uint32_t latency_overruns = 0;  // Of every ROMC code
+
+/*! \brief Read the counter at the rising edge of WRITE */
+__force_inline uint32_t latency_start() {
+    return cycle_count();
+}
+
+/*! \brief Add the time since latency_start() to the histogram of the current ROMC code. Must be called from core 1 */
+__force_inline void latency_record(uint32_t start) {
+    uint32_t cycles = cycles_elapsed(start, cycle_count());
+    RomcLatency &latency = romc_latency[romc];
+    uint32_t bin = cycles >> LATENCY_BIN_SHIFT;
+    latency.bins[bin < LATENCY_BINS ? bin : LATENCY_BINS - 1]++;
+    latency.min = cycles < latency.min ? cycles : latency.min;
+    latency.max = cycles > latency.max ? cycles : latency.max;
+    latency.count++;
+    if (cycles > LATENCY_LIMIT_CYCLES) {
+        latency.overruns++;
+        if (latency_overruns++ == 0) {
+            first_overrun = {cycles, romc, pc0, time_us_32()};
+        }
+    }
+}
+
+/*! \brief Work out a percentile of a ROMC code's latency
+ *
+ * \param latency The histogram
+ * \param per_mille The percentile, in tenths of a percent (e.g. 990 for the 99th)
+ * \return The upper edge of the bin it falls in, in cycles, capped to the maximum
+ */
+uint32_t latency_percentile(const RomcLatency &latency, uint32_t per_mille) {
+    uint64_t target = ((uint64_t) latency.count * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+    for (uint8_t bin = 0; bin < LATENCY_BINS - 1; bin++) {
+        seen += latency.bins[bin];
+        if (seen >= target) {
+            uint32_t edge = (bin + 1) << LATENCY_BIN_SHIFT;
+            return edge < latency.max ? edge : latency.max;
+        }
+    }
+    return latency.max;
+}
+
+/*! \brief Print the latency of each ROMC code seen so far
+ *
+ * \param out Where to print the report (e.g. Serial)
+ */
+void print_latency(Print &out) {
+    out.printf("Bus latency @ %lu MHz, limit %lu ns, %lu overruns\n", clock_get_hz(clk_sys) / 1000000, LATENCY_LIMIT_NS,
+               latency_overruns);
+    if (latency_overruns != 0) {
+        out.printf("First overrun: ROMC 0x%02X took %lu ns, PC0 %04X, %lu us after power on\n", first_overrun.romc,
+                   cycles_to_ns(first_overrun.cycles), first_overrun.pc0, first_overrun.time_us);
+    }
+    out.printf("ROMC |    count | min ns | p50 ns | p90 ns | p99 ns | p99.9 ns | max ns | overruns\n");
+    for (uint8_t code = 0; code < 32; code++) {
+        const RomcLatency &l = romc_latency[code];
+        if (l.count != 0) {
+            out.printf("0x%02X | %8lu | %6lu | %6lu | %6lu | %6lu | %8lu | %6lu | %lu\n", code, l.count, cycles_to_ns(l.min),
+                       cycles_to_ns(latency_percentile(l, 500)), cycles_to_ns(latency_percentile(l, 900)),
+                       cycles_to_ns(latency_percentile(l, 990)), cycles_to_ns(latency_percentile(l, 999)),
+                       cycles_to_ns(l.max), l.overruns);
+        }
+    }
+}
@@ -7,6 +7,19 @@
  * Channel F programs, providing all the necessary information to preserve
  * and load it.
  * 
+ * Either can be packed with Tools/pack_rom.py, which compresses the data with
+ * LZ4 to be decoded straight into memory as it's read (see lz4_decode()). A
+ * packed BIN file is a packed_bin_header followed by an LZ4 block of the whole
+ * file. A packed chip packet has the magic number "CHPZ" instead of "CHIP",
+ * and an LZ4 block of its data in place of the data. Only chip packets of bank
+ * 0 are packed.
+ * 
+ * Chip packets with a non-zero bank_number are loaded into banked memory (see
+ * chips.hpp), and the game is given a BankSelect port. They're read in a second
+ * pass over the packets, once bank 0 is complete, as each banked page starts
+ * as a copy of bank 0. Games for MK3870 carts
+ * are given its ports (see mk3870.hpp).
+ * 
  * Refer to the [CHF repository](https://github.com/ZX-80/Videocart-Image-Format)
  * for more information.
  */
@@ -14,8 +27,13 @@
 #pragma once
 
 #include "chips.hpp"
+#include "config.hpp"
 #include "error.hpp"
+#include "fram.hpp"
+#include "mk3870.hpp"
 #include "ports.hpp"
+#include "save_state.hpp"
+#include "smi.hpp"
 
 #include <SPI.h>
 #include <SD.h>
@@ -29,6 +47,10 @@ struct __attribute__((packed)) chf_header {
     uint64_t reserved;
     uint8_t title_length;
 };
+namespace HARDWARE_TYPE {
+    inline constexpr uint16_t MK3870 = MK3870_HARDWARE_TYPE;  // Cart with an MK3870/3871, which has ports 6 and 7 (provisional, see config.hpp)
+}
+
 struct __attribute__((packed)) chip_header {
     char magic_number[4];
     uint32_t packet_length;
@@ -38,92 +60,454 @@ struct __attribute__((packed)) chip_header {
     uint16_t size;
 };
 
-/*! \brief Load a program from the CHF File into program_rom
- * 
- * \param romFile the CHF file to load
+inline constexpr uint32_t LOAD_BLOCK_SIZE = 4096;  // Staging buffer size, a multiple of the SD sector size
+inline constexpr uint32_t SD_SECTOR_SIZE = 512;
+
+/*! \brief Buffered, forward-only reader for ROM files
+ *
+ * \details The file is read in large sector-aligned blocks into a staging
+ * buffer, and headers are parsed straight out of it. Payloads that don't fit
+ * in what's left of the buffer are read directly into their destination, so
+ * most of a file is moved with a few multi-block reads.
+ *
+ * A stream can also read a file that is already in memory, such as a copy in
+ * the flash cache (see flash_cache.hpp).
  */
-void read_chf_file(uint8_t program_rom[], File &romFile) { // FIXME: just use the global program_rom
-    // It's guaranteed the first 16 bytes are valid & the file size is >= 64 (file_header[48] + chip_header[16])
+class LoadStream {
+    private:
+        File* file = nullptr;
+        const uint8_t* data = nullptr;  // The file, if it's in memory
+        uint32_t file_size;
+        uint32_t file_position = 0;  // Where the next File::read() starts
+        uint32_t offset = 0;         // File offset of buffer[0]
+        uint32_t start = 0;          // Buffered bytes are [start, end)
+        uint32_t end = 0;
+        alignas(4) inline static uint8_t buffer[LOAD_BLOCK_SIZE];
 
-    // Read header
-    chf_header header;
-    romFile.read((uint8_t*) &header, sizeof(chf_header));
+        uint32_t file_read(uint8_t* destination, uint32_t position, uint32_t size) {
+            if (data != nullptr) {
+                uint32_t length = position < file_size ? min(size, file_size - position) : 0;
+                memcpy(destination, data + position, length);
+                return length;
+            }
+            if (position != file_position && !file->seek(position, SeekSet)) {
+                return 0;
+            }
+            uint32_t length = file->read(destination, size);
+            file_position = position + length;
+            reads++;
+            return length;
+        }
 
-    // Read title
-    char title[257] = {0};
-    romFile.read((uint8_t*) &title, header.title_length + 1);
-    romFile.seek(header.header_length, SeekSet); // Skip padding
+        /*! \brief Read more of the file into the buffer, ending on a sector boundary */
+        void refill() {
+            memmove(buffer, buffer + start, end - start);
+            offset += start;
+            end -= start;
+            start = 0;
+            uint32_t position = offset + end;
+            uint32_t size = LOAD_BLOCK_SIZE - end;
+            size -= (position + size) % SD_SECTOR_SIZE;
+            end += file_read(buffer + end, position, size);
+        }
 
-    // Read chip packets
-    chip_header ch;
-    size_t header_start = romFile.position();
-    romFile.read((uint8_t*) &ch, sizeof(ch));
-    while (strncmp(ch.magic_number, "CHIP", 4) == 0) {
-        // Set attribute and pull data
-        memset(program_attribute + ch.load_address, ch.chip_type, ch.size);
-        size_t chip_types_length = sizeof(ChipTypes) / sizeof(ChipTypes[0]);
-        if (ch.chip_type < chip_types_length && ChipTypes[ch.chip_type]->has_data()) {
-            romFile.read((uint8_t*) (program_rom + ch.load_address), ch.size);
-            romFile.seek(header_start + ch.packet_length, SeekSet); // Skip padding
-        }
-        
-        // Next packet
-        if ((romFile.size() - romFile.position()) >= 16) {
-            header_start = romFile.position();
-            romFile.read((uint8_t*) &ch, sizeof(ch));
+    public:
+        uint32_t reads = 0;  // Number of File::read() calls (none for files in memory)
+
+        LoadStream(File &file): file(&file), file_size(file.size()) {
+            file.seek(0, SeekSet);
+        }
+
+        LoadStream(const uint8_t* data, uint32_t size): data(data), file_size(size) {}
+
+        uint32_t size() {return file_size;}
+        uint32_t position() {return offset + start;}
+        uint32_t remaining() {return file_size - position();}
+
+        /*! \brief Take the next bytes of the file, without copying them
+         *
+         * \param size Number of bytes, at most LOAD_BLOCK_SIZE / 2
+         * \return The bytes, valid until the next call, or nullptr if the file is too short
+         */
+        const uint8_t* take(uint32_t size) {
+            if (end - start < size) {
+                refill();
+                if (end - start < size) {
+                    return nullptr;
+                }
+            }
+            const uint8_t* data = buffer + start;
+            start += size;
+            return data;
+        }
+
+        /*! \brief Copy the next bytes of the file
+         *
+         * \param destination Where to copy the bytes
+         * \param size Number of bytes
+         * \return false if the file is too short
+         */
+        bool read(uint8_t* destination, uint32_t size) {
+            while (size > 0) {
+                if (start == end && size >= SD_SECTOR_SIZE) { // Nothing buffered, read straight into place
+                    uint32_t length = file_read(destination, offset + end, size);
+                    offset += end + length;
+                    start = end = 0;
+                    return length == size;
+                }
+                if (start == end) {
+                    refill();
+                    if (start == end) {
+                        return false;
+                    }
+                }
+                uint32_t length = min(size, end - start);
+                memcpy(destination, buffer + start, length);
+                start += length;
+                destination += length;
+                size -= length;
+            }
+            return true;
+        }
+
+        /*! \brief Move forward to a position in the file */
+        void skip_to(uint32_t position) {
+            if (position >= offset && position <= offset + end) {
+                start = position - offset;
+            } else {
+                offset = position;
+                start = end = 0;
+            }
+        }
+};
+
+/*! \brief Decode an LZ4 block from a stream straight into memory
+ *
+ * \details Literals are copied with LoadStream::read(), so long runs of them
+ * go from the file straight into place, and matches are copied from what was
+ * already decoded, so no buffer is needed beyond the stream's own. Every length
+ * and offset is checked before it's used.
+ *
+ * \param stream The file, at the start of the block
+ * \param packed_size Size of the block in the file
+ * \param destination Where to decode to
+ * \param size Size of the decoded data
+ * \return false if the block is invalid or doesn't decode to exactly size bytes
+ */
+bool lz4_decode(LoadStream &stream, uint32_t packed_size, uint8_t* destination, uint32_t size) {
+    uint32_t end = stream.position() + packed_size;
+    uint32_t produced = 0;
+    auto next_byte = [&](uint8_t &value) {
+        const uint8_t* data = stream.position() < end ? stream.take(1) : nullptr;
+        value = data != nullptr ? *data : 0;
+        return data != nullptr;
+    };
+    auto extend = [&](uint32_t &length) { // Lengths of 15 continue in the bytes after
+        uint8_t value = length == 15 ? 255 : 0;
+        while (value == 255) {
+            if (!next_byte(value)) {
+                return false;
+            }
+            length += value;
+        }
+        return true;
+    };
+
+    while (true) {
+        uint8_t token;
+        if (!next_byte(token)) {
+            return false;
+        }
+        uint32_t literals = token >> 4;
+        if (!extend(literals) || literals > size - produced || literals > end - stream.position()
+            || !stream.read(destination + produced, literals)) {
+            return false;
+        }
+        produced += literals;
+        if (stream.position() == end) {
+            return produced == size; // The last sequence has no match
+        }
+
+        uint8_t low, high;
+        uint32_t match = token & 0xF;
+        if (!next_byte(low) || !next_byte(high) || !extend(match)) {
+            return false;
+        }
+        uint32_t offset = low | high << 8;
+        match += 4;
+        if (offset == 0 || offset > produced || match > size - produced) {
+            return false;
+        }
+        uint8_t* to = destination + produced;
+        const uint8_t* from = to - offset;
+        if (offset >= match) {
+            memcpy(to, from, match);
         } else {
+            for (uint32_t i = 0; i < match; i++) { // Overlapping, repeats the last offset bytes
+                to[i] = from[i];
+            }
+        }
+        produced += match;
+    }
+}
+
+namespace LOAD_FORMAT {
+    inline constexpr uint8_t BIN = 0;
+    inline constexpr uint8_t CHF = 1;
+    inline constexpr uint8_t PACKED_BIN = 2;
+    inline constexpr uint8_t COUNT = 3;
+}
+inline constexpr const char* LOAD_FORMAT_NAMES[LOAD_FORMAT::COUNT] = {"BIN", "CHF", "Packed BIN"};
+
+inline constexpr char PACKED_BIN_MAGIC[4] = {'P', 'V', 'Z', '4'};
+inline constexpr char PACKED_CHIP_MAGIC[4] = {'C', 'H', 'P', 'Z'};
+
+struct __attribute__((packed)) packed_bin_header {
+    char magic_number[4];
+    uint32_t size;  // Size of the .bin file it was packed from
+};
+
+struct LoadStats {
+    uint32_t bytes;   // File size
+    uint32_t loaded;  // Bytes placed in memory, after decoding
+    uint32_t us;      // Time from opening to loaded
+    uint32_t reads;   // SD reads issued
+    uint32_t loads;
+};
+
+inline LoadStats load_stats[LOAD_FORMAT::COUNT] = {};  // Last load of each LOAD_FORMAT
+inline uint32_t load_bytes = 0;  // Bytes placed in memory by the load in progress
+
+/*! \brief Read the data of a chip packet into another bank
+ *
+ * \param stream The CHF file, at the start of the data
+ * \param ch The chip packet header
+ * \return false if the bank doesn't fit or the file is too short
+ */
+bool read_banked_data(LoadStream &stream, const chip_header &ch) {
+    uint32_t address = ch.load_address;
+    uint32_t end = address + ch.size;
+    while (address < end) {
+        uint32_t length = min(end - address, 0x100 - (address & 0xFF));
+        uint8_t* page = ch.bank_number <= 0xFF ? bank_page(ch.bank_number, address >> 8) : nullptr;
+        if (page == nullptr || !stream.read(page + (address & 0xFF), length)) {
+            return false;
+        }
+        address += length;
+    }
+    return true;
+}
+
+/*! \brief Read the data of every chip packet of another bank, after bank 0 is loaded
+ *
+ * \param stream The CHF file
+ * \param start Position of the first chip packet
+ * \return false if a bank doesn't fit
+ */
+bool read_banked_packets(LoadStream &stream, uint32_t start) {
+    stream.skip_to(start);
+    while (stream.remaining() >= sizeof(chip_header)) { // Packets were checked by the first pass
+        uint32_t packet_start = stream.position();
+        const chip_header* packet = (const chip_header*) stream.take(sizeof(chip_header));
+        if (packet == nullptr || (strncmp(packet->magic_number, "CHIP", 4) != 0
+                                  && strncmp(packet->magic_number, PACKED_CHIP_MAGIC, 4) != 0)) {
             break;
         }
+        chip_header ch = *packet;
+        if (ch.bank_number != 0 && chip_has_data(ch.chip_type) && !read_banked_data(stream, ch)) {
+            return false;
+        }
+        stream.skip_to(packet_start + ch.packet_length);
     }
+    return true;
 }
 
-void __not_in_flash_func(load_game)(File &romFile) {
-    for (uint16_t i = 0; i <= 0xFF; i++) { // Unload IOPorts
-       delete IOPorts[i];
-       IOPorts[i] = nullptr;
+/*! \brief Load a program from the CHF File into program_rom
+ *
+ * \details Every length in the file is checked before it's used, and loading
+ * stops at the first one that doesn't fit in the file or the address space.
+ *
+ * \param stream The CHF file to load, at position 0
+ * \param hardware_type Set to the hardware type from the header
+ * \return false if the file is invalid
+ */
+bool read_chf_file(LoadStream &stream, uint16_t &hardware_type) {
+    // Read header
+    const chf_header* header = (const chf_header*) stream.take(sizeof(chf_header));
+    if (header == nullptr || header->header_length < sizeof(chf_header) + header->title_length + 1
+        || header->header_length > stream.size()) {
+        return false;
+    }
+    hardware_type = header->hardware_type;
+    uint32_t header_length = header->header_length;
+
+    // Tag NVRAM with the header and title, so another game's save isn't loaded (see fram.hpp)
+    uint32_t tagged = sizeof(chf_header) + header->title_length;
+    stream.skip_to(0);
+    const uint8_t* title = stream.take(tagged);
+    if (title == nullptr) {
+        return false;
+    }
+    uint32_t tag = SIGNATURE_SEED;
+    for (uint32_t i = 0; i < tagged; i++) {
+        tag = (tag ^ title[i]) * 16777619u;
     }
+    nvram_begin(tag);
+    stream.skip_to(header_length); // Skip title and padding
 
-    // TODO: should probably zero the following (although writing to undefined memory could simply be undefined)
-    // program_attribute
-    // program_rom
-    // A: Zero the attribute. Then any attempt to access ROM will return 0xFF
-    
-
-    if (romFile) {
-        uint8_t magic_buffer[17] = {0};
-        romFile.read((uint8_t*) magic_buffer, 1); // Read up to 1 byte into magic_buffer
-        if (magic_buffer[0] == 0x55) { // .bin file
-
-            // TODO: perform after read to memory, use $FF (restricted) for ROM that isn't loaded (i.e. 64K - filesize)
-            // Assume hardware type 2 (ROM+RAM) with 2K of RAM at 0x2800,
-            // fill 64K with RESERVED, fill ROM with <filesize> ROM, fill 0x2800 with RAM
-            // memset(program_attribute, RESERVED_CT::ID, 0x800);  BIOS
-            // memset(program_attribute + 0x800, ROM_CT::id, 0xF800);  ROM
-            memset(program_attribute + 0x2800, RAM_CT::id, 0x800);
-
-            // Clear RAM: attempt at fixing hangman
-            memset(program_rom + 0x2800, 0, 0x800);
-
-            // Assume 2012 SRAM on ports $20/$21/$24/$25
-            IOPorts[0x20] = new Sram2102(0);
-            IOPorts[0x21] = new Sram2102(1);
-            IOPorts[0x24] = new Sram2102(0);
-            IOPorts[0x25] = new Sram2102(1);
-            IOPorts[0xFF] = new Launcher(file_data);
-
-            // Read up to 62K into program_rom
-            romFile.seek(0, SeekSet);
-            romFile.read((uint8_t*) (program_rom + 0x800), min(romFile.size(), 0xF7FF)); // Read up to 62K into program_rom
-        } else if (magic_buffer[0] == 'C' && romFile.size() >= 64) {                     // possible .chf file
-            romFile.seek(0, SeekSet);
-            romFile.read((uint8_t*) magic_buffer, 16);                   // Read 16 bytes into magic_buffer
-            if (strcmp((char*) magic_buffer, "CHANNEL F       ") == 0) { // .chf file
-                romFile.seek(0, SeekSet);
-                read_chf_file(program_rom, romFile);
+    // Read chip packets
+    bool banked = false;
+    while (stream.remaining() >= sizeof(chip_header)) {
+        uint32_t packet_start = stream.position();
+        const chip_header* packet = (const chip_header*) stream.take(sizeof(chip_header));
+        if (packet == nullptr) {
+            break;
+        }
+        bool packed = strncmp(packet->magic_number, PACKED_CHIP_MAGIC, 4) == 0;
+        if (!packed && strncmp(packet->magic_number, "CHIP", 4) != 0) {
+            break;
+        }
+        chip_header ch = *packet; // The buffer may move while the payload is read
+        bool has_data = chip_has_data(ch.chip_type);
+        if (ch.packet_length < sizeof(chip_header) + (has_data && !packed ? ch.size : 0)
+            || ch.packet_length > stream.size() - packet_start
+            || (uint32_t) ch.load_address + ch.size > 0x10000
+            || (packed && (!has_data || ch.bank_number != 0))) { // Banks aren't contiguous, so they're never packed
+            return false;
+        }
+
+        // Set attribute and pull data
+        map_chip(ch.load_address, ch.size, ch.chip_type);
+        if (packed && !lz4_decode(stream, ch.packet_length - sizeof(chip_header), program_rom + ch.load_address, ch.size)) {
+            return false;
+        }
+        if (!packed && has_data && ch.bank_number == 0 && !stream.read(program_rom + ch.load_address, ch.size)) {
+            return false;
+        }
+        banked |= has_data && ch.bank_number != 0; // Read by read_banked_packets()
+        load_bytes += has_data ? ch.size : 0;
+        if (ch.chip_type == NVRAM_CT::id) {
+            nvram_load(ch.load_address, ch.size); // Saved data replaces the initial contents, if it is this game's
+        }
+        stream.skip_to(packet_start + ch.packet_length); // Skip padding
+    }
+    return !banked || read_banked_packets(stream, header_length);
+}
+
+/*! \brief Remove the current program, its memory map and its ports */
+void unload_game() {
+    nvram_flush(); // Save the previous game's NVRAM before it's replaced
+    save_end();
+
+    ports_clear();
+
+    // TODO: should probably zero program_rom (although writing to undefined memory could simply be undefined)
+    memory_map_clear(ROM_CT::id);
+    bank_reset();
+    smi_reset();
+    mk3870_reset();
+    interrupts_reset();
+}
+
+/*! \brief Replace the current program with a BIN or CHF file
+ *
+ * \param stream The file
+ * \return false if the file is invalid
+ */
+bool __not_in_flash_func(load_rom)(LoadStream &stream) {
+    uint32_t start_us = time_us_32();
+    unload_game();
+
+    bool valid = true;
+    uint8_t format = LOAD_FORMAT::BIN;
+    load_bytes = 0;
+    const uint8_t* magic = stream.take(sizeof(packed_bin_header));
+    bool packed = magic != nullptr && strncmp((const char*) magic, PACKED_BIN_MAGIC, 4) == 0;
+    uint32_t packed_size = packed ? ((const packed_bin_header*) magic)->size : 0;
+    stream.skip_to(0);
+    magic = stream.take(1);
+    if (magic != nullptr && (magic[0] == 0x55 || packed)) { // .bin file, or a packed one
+
+        // TODO: perform after read to memory, use $FF (restricted) for ROM that isn't loaded (i.e. 64K - filesize)
+        // Assume hardware type 2 (ROM+RAM) with 2K of RAM at 0x2800,
+        // fill 64K with RESERVED, fill ROM with <filesize> ROM, fill 0x2800 with RAM
+        // map_chip(0, 0x800, RESERVED_CT::ID);  BIOS
+        // map_chip(0x800, 0xF800, ROM_CT::id);  ROM
+        map_chip(0x2800, 0x800, RAM_CT::id);
+
+        // Clear RAM: attempt at fixing hangman
+        memset(program_rom + 0x2800, 0, 0x800);
+
+        // Assume 2012 SRAM on ports $20/$21/$24/$25
+        port_attach<Sram2102>(0x20);
+        port_attach<Sram2102>(0x21);
+        port_attach<Sram2102>(0x24);
+        port_attach<Sram2102>(0x25);
+        port_attach<Launcher>(0xFF);
+        if constexpr (SAVE_STATES) {
+            port_attach<SaveControl>(SAVE_CONTROL_PORT);
+        }
+        Launcher::reset();
+
+        if (packed) {
+            format = LOAD_FORMAT::PACKED_BIN;
+            stream.skip_to(sizeof(packed_bin_header));
+            valid = packed_size <= 0xF7FF && lz4_decode(stream, stream.remaining(), program_rom + 0x800, packed_size);
+            load_bytes = packed_size;
+        } else {
+            stream.skip_to(0);
+            load_bytes = min(stream.size(), (uint32_t) 0xF7FF);
+            stream.read(program_rom + 0x800, load_bytes); // Read up to 62K into program_rom
+        }
+    } else if (magic != nullptr && magic[0] == 'C' && stream.size() >= 64) {    // possible .chf file
+        stream.skip_to(0);
+        magic = stream.take(16);
+        if (magic != nullptr && strncmp((const char*) magic, "CHANNEL F       ", 16) == 0) {        // .chf file
+            format = LOAD_FORMAT::CHF;
+            stream.skip_to(0);
+            uint16_t hardware_type = 0;
+            valid = read_chf_file(stream, hardware_type);
+            if (bank_count > 1) {
+                port_attach<BankSelect>(BANK_SELECT_PORT);
+            }
+            if (hardware_type == HARDWARE_TYPE::MK3870) {
+                port_attach<Mk3870Port>(MK3870_CONTROL_PORT);
+                port_attach<Mk3870Port>(MK3870_TIMER_PORT);
             }
         }
-        romFile.close();
-    } else {
+    }
+
+    port_attach<SmiPort>(SMI_VECTOR_HIGH_PORT); // The SMI is always there
+    port_attach<SmiPort>(SMI_VECTOR_LOW_PORT);
+    port_attach_write_only<SmiPort>(SMI_CONTROL_PORT); // Can't be read back
+    port_attach_write_only<SmiPort>(SMI_TIMER_PORT);
+
+    LoadStats &stats = load_stats[format];
+    stats.bytes = stream.size();
+    stats.loaded = load_bytes;
+    stats.us = time_us_32() - start_us;
+    stats.reads = stream.reads;
+    stats.loads++;
+
+    if (!valid) {
+        blink_code(BLINK::INVALID_FILE);
+    }
+    return valid;
+}
+
+/*! \brief Replace the current program with a ROM file
+ *
+ * \param romFile The BIN or CHF file, or a closed file to just unload
+ * \return false if there was no file or it is invalid
+ */
+bool load_game(File &romFile) {
+    if (!romFile) {
+        unload_game();
         blink_code(BLINK::NO_VALID_FILES);
+        return false;
     }
+    LoadStream stream(romFile);
+    bool valid = load_rom(stream);
+    romFile.close();
+    return valid;
 }
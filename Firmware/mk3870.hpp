@@ -0,0 +1,184 @@
+/** \file mk3870.hpp
+ *
+ * \brief Interrupt control and binary timer ports of the MK3870/3871
+ *
+ * \details Carts built around an MK3870 or 3871 have an 8-bit binary timer on
+ * port 7, and an interrupt control register on port 6. They're attached for
+ * CHF files with HARDWARE_TYPE::MK3870 (see loader.hpp).
+ *
+ * Interrupt control register (port 6):
+ *
+ *  Bit | Function
+ *  ----|---------
+ *  0   | External interrupt enable
+ *  1   | Timer interrupt enable
+ *  2   | External interrupt active level (0 = low)
+ *  3   | Start (1) or stop (0) the timer
+ *  4   | Event counter mode (with no prescaler)
+ *  5   | Prescale by 2
+ *  6   | Prescale by 5
+ *  7   | Prescale by 20
+ *
+ * In interval timer mode, the timer counts down once every prescale PHI
+ * periods, where the prescale is the product of bits 5 - 7 (2 to 200). Going
+ * from 1 to 0 requests a timer interrupt and reloads the value last written to
+ * port 7 (0 counts as 256). Reading port 7 gives the current count. Timer
+ * interrupts go to 0x0020, and external ones to 0x00A0.
+ *
+ * The timer is a PhiTimer (see phi_timer.hpp), so core 1 doesn't count. The
+ * pulse width and event counter modes, selected with no prescaler bits set,
+ * aren't emulated, and leave the timer stopped. Reading the count multiplies
+ * by a reciprocal of the prescale from MK3870_PRESCALES, rather than
+ * dividing.
+ *
+ * Refer to the MK3870 datasheet for more information.
+ */
+
+#pragma once
+
+#include "interrupts.hpp"
+#include "phi_timer.hpp"
+#include "ports.hpp"
+
+inline constexpr uint8_t MK3870_CONTROL_PORT = 0x06;
+inline constexpr uint8_t MK3870_TIMER_PORT = 0x07;
+inline constexpr uint16_t MK3870_TIMER_VECTOR = 0x0020;
+inline constexpr uint16_t MK3870_EXTERNAL_VECTOR = 0x00A0;
+
+namespace MK3870_CONTROL {
+    inline constexpr uint8_t EXTERNAL_ENABLE = 0x01;
+    inline constexpr uint8_t TIMER_ENABLE = 0x02;
+    inline constexpr uint8_t ACTIVE_HIGH = 0x04;
+    inline constexpr uint8_t START = 0x08;
+    inline constexpr uint8_t PRESCALE_2 = 0x20;
+    inline constexpr uint8_t PRESCALE_5 = 0x40;
+    inline constexpr uint8_t PRESCALE_20 = 0x80;
+}
+
+struct Mk3870 {
+    uint8_t control = 0;
+    uint8_t reload = 0;            // Value last written to the timer
+    uint8_t count = 0;             // Count while stopped
+    uint32_t prescale = 0;         // PHI periods per count while running, 0 while stopped
+    uint32_t reciprocal = 0;       // Of the prescale, from MK3870_PRESCALES
+    PhiTimer timer;
+};
+
+inline Mk3870 mk3870;
+
+/*! \brief Get the prescale selected by the control register, or 0 if it's not in interval timer mode */
+constexpr uint32_t mk3870_prescale(uint8_t control) {
+    uint32_t prescale = 1;
+    prescale *= control & MK3870_CONTROL::PRESCALE_2 ? 2 : 1;
+    prescale *= control & MK3870_CONTROL::PRESCALE_5 ? 5 : 1;
+    prescale *= control & MK3870_CONTROL::PRESCALE_20 ? 20 : 1;
+    return prescale == 1 ? 0 : prescale;
+}
+
+static_assert(mk3870_prescale(0x20) == 2 && mk3870_prescale(0x60) == 10 && mk3870_prescale(0xE0) == 200, "Prescales multiply");
+static_assert(mk3870_prescale(0x10) == 0, "No prescaler bits is not interval timer mode");
+
+/*! \brief Each prescale and 2^24 / prescale, rounded up, by bits 5 - 7 of the control register */
+struct Mk3870Prescales {
+    uint32_t prescale[8];
+    uint32_t reciprocal[8];
+
+    constexpr Mk3870Prescales(): prescale(), reciprocal() {
+        for (uint8_t i = 0; i < 8; i++) {
+            prescale[i] = mk3870_prescale(i << 5);
+            reciprocal[i] = prescale[i] ? ((1u << 24) + prescale[i] - 1) / prescale[i] : 0;
+        }
+    }
+};
+
+inline constexpr Mk3870Prescales MK3870_PRESCALES;
+
+/*! \brief Divide by a prescale, as periods * reciprocal >> 24 without overflowing 32 bits
+ *
+ * \param periods PHI periods, less than 2^16
+ * \param reciprocal The reciprocal of the prescale
+ * \return The whole counts in periods
+ */
+constexpr uint32_t mk3870_divide(uint32_t periods, uint32_t reciprocal) {
+    return (periods * (reciprocal >> 16) + (periods * (reciprocal & 0xFFFF) >> 16)) >> 8;
+}
+
+/*! \brief Check mk3870_divide() is exact for every count of every prescale */
+constexpr bool mk3870_reciprocals_valid() {
+    for (uint8_t i = 0; i < 8; i++) {
+        uint32_t prescale = MK3870_PRESCALES.prescale[i];
+        for (uint32_t periods = 1; prescale != 0 && periods <= 256 * prescale + prescale - 1; periods++) {
+            if (mk3870_divide(periods, MK3870_PRESCALES.reciprocal[i]) != periods / prescale) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static_assert(mk3870_reciprocals_valid(), "Counts must not depend on rounding");
+
+/*! \brief Get the current count of the timer */
+uint8_t mk3870_count() {
+    if (mk3870.prescale == 0) {
+        return mk3870.count;
+    }
+    return mk3870_divide(mk3870.timer.remaining() + mk3870.prescale - 1, mk3870.reciprocal); // Rounded up
+}
+
+/*! \brief Start or stop the timer, to match the control register
+ *
+ * \details A running timer is restarted from its current count, so a change
+ * of prescale takes effect from the next count.
+ */
+void mk3870_update_timer() {
+    uint32_t prescale = MK3870_CONTROL::START & mk3870.control ? MK3870_PRESCALES.prescale[mk3870.control >> 5] : 0;
+    mk3870.count = mk3870_count();
+    mk3870.prescale = prescale;
+    mk3870.reciprocal = MK3870_PRESCALES.reciprocal[mk3870.control >> 5];
+    if (prescale == 0) {
+        mk3870.timer.stop();
+        return;
+    }
+    uint32_t period = (mk3870.reload ? mk3870.reload : 256) * prescale;
+    uint32_t first = (mk3870.count ? mk3870.count : 256) * prescale;
+    mk3870.timer.start(first, period);
+}
+
+/*! \brief Claim the timer. Must be called from core 0, after interrupts_init() */
+void mk3870_init() {
+    mk3870.timer.init([]() {interrupt_request(INTERRUPT::MK3870_TIMER);});
+    interrupt_sources[INTERRUPT::MK3870_TIMER].vector = MK3870_TIMER_VECTOR;
+    interrupt_sources[INTERRUPT::MK3870_EXTERNAL].vector = MK3870_EXTERNAL_VECTOR;
+}
+
+/*! \brief Stop the timer, for the next game */
+void mk3870_reset() {
+    mk3870.timer.stop();
+    mk3870.control = mk3870.reload = mk3870.count = 0;
+    mk3870.prescale = mk3870.reciprocal = 0;
+    interrupt_sources[INTERRUPT::MK3870_EXTERNAL].external_edges = 0;
+}
+
+/*! \brief Port 6 or 7 of the MK3870/3871 */
+class Mk3870Port {
+    public:
+        static uint8_t read(uint8_t port) {
+            return port == MK3870_TIMER_PORT ? mk3870_count() : mk3870.control;
+        }
+
+        static void write(uint8_t port, uint8_t data) {
+            if (port == MK3870_TIMER_PORT) {
+                mk3870.reload = data;
+                mk3870.count = data;
+                mk3870.prescale = 0; // Start again from the new value
+            } else {
+                mk3870.control = data;
+                bool high = data & MK3870_CONTROL::ACTIVE_HIGH;
+                interrupt_sources[INTERRUPT::MK3870_EXTERNAL].external_edges = high ? GPIO_IRQ_EDGE_RISE : GPIO_IRQ_EDGE_FALL;
+                interrupt_enable(INTERRUPT::MK3870_EXTERNAL, data & MK3870_CONTROL::EXTERNAL_ENABLE);
+                interrupt_enable(INTERRUPT::MK3870_TIMER, data & MK3870_CONTROL::TIMER_ENABLE);
+            }
+            mk3870_update_timer();
+        }
+};
@@ -0,0 +1,125 @@
+/** \file phi_timer.hpp
+ *
+ * \brief Timers that count PHI periods on a PIO state machine
+ *
+ * \details Used by the timers of the 3853 SMI (smi.hpp) and the MK3870
+ * (mk3870.hpp), so neither has to be ticked by core 1. Every timer runs the
+ * same program on its own state machine of pio1:
+ *
+ * ```
+ *     pull block                        ; Periods between expiries - 1
+ *     mov y, osr
+ *     pull block                        ; Periods until the first expiry - 1
+ *     mov x, osr
+ * count:
+ *     wait 1 gpio PHI                   ; One PHI period
+ *     wait 0 gpio PHI
+ *     jmp x-- count
+ *     irq nowait 0 rel                  ; Expired, raise the flag of this state machine
+ *     mov x, y
+ *     jmp count
+ * ```
+ *
+ * The flags are handled on core 0, which calls the expired() function of the
+ * timer. PHI runs at ~1.79 MHz, so a state machine spends most of its time
+ * waiting.
+ */
+
+#pragma once
+
+#include "gpio.hpp"
+
+#include <hardware/irq.h>
+#include <hardware/pio.h>
+#include <hardware/pio_instructions.h>
+
+inline PIO const PHI_TIMER_PIO = pio1;
+inline constexpr uint8_t PHI_TIMER_COUNT_INSTRUCTION = 4;  // Offset of `count`
+
+/*! \brief A PHI period counter with its own state machine */
+class PhiTimer {
+    private:
+        uint sm = 0;
+
+        static void load_program() {
+            uint16_t instructions[] = {
+                (uint16_t) pio_encode_pull(false, true),
+                (uint16_t) pio_encode_mov(pio_y, pio_osr),
+                (uint16_t) pio_encode_pull(false, true),
+                (uint16_t) pio_encode_mov(pio_x, pio_osr),
+                (uint16_t) pio_encode_wait_gpio(true, PHI_PIN),
+                (uint16_t) pio_encode_wait_gpio(false, PHI_PIN),
+                (uint16_t) pio_encode_jmp_x_dec(PHI_TIMER_COUNT_INSTRUCTION),
+                (uint16_t) pio_encode_irq_set(true, 0),
+                (uint16_t) pio_encode_mov(pio_x, pio_y),
+                (uint16_t) pio_encode_jmp(PHI_TIMER_COUNT_INSTRUCTION),
+            };
+            const pio_program_t program = {instructions, sizeof(instructions) / sizeof(instructions[0]), -1};
+            offset = pio_add_program(PHI_TIMER_PIO, &program); // Relocates the jmps
+            irq_set_exclusive_handler(PIO1_IRQ_0, phi_timer_irq);
+            irq_set_enabled(PIO1_IRQ_0, true);
+        }
+
+        static void phi_timer_irq() {
+            for (uint8_t sm = 0; sm < 4; sm++) {
+                if (pio_interrupt_get(PHI_TIMER_PIO, sm)) {
+                    pio_interrupt_clear(PHI_TIMER_PIO, sm);
+                    timers[sm]->expired();
+                }
+            }
+        }
+
+    public:
+        void (*expired)() = nullptr;  // Called on core 0 each time the timer expires
+        inline static uint offset;
+        inline static PhiTimer* timers[4] = {};  // By state machine
+
+        /*! \brief Claim a state machine, loading the program on first use. Must be called from core 0 */
+        void init(void (*handler)()) {
+            if (timers[0] == nullptr && timers[1] == nullptr && timers[2] == nullptr && timers[3] == nullptr) {
+                load_program();
+            }
+            sm = pio_claim_unused_sm(PHI_TIMER_PIO, true);
+            timers[sm] = this;
+            expired = handler;
+            pio_sm_config c = pio_get_default_sm_config();
+            sm_config_set_clkdiv_int_frac(&c, 1, 0);
+            pio_sm_init(PHI_TIMER_PIO, sm, offset, &c);
+            pio_set_irq0_source_enabled(PHI_TIMER_PIO, (pio_interrupt_source) (pis_interrupt0 + sm), true);
+        }
+
+        /*! \brief Stop counting */
+        void stop() {
+            pio_sm_set_enabled(PHI_TIMER_PIO, sm, false);
+            pio_sm_clear_fifos(PHI_TIMER_PIO, sm);
+            pio_sm_restart(PHI_TIMER_PIO, sm);
+        }
+
+        /*! \brief Start counting from the beginning
+         *
+         * \param first PHI periods until the first expiry, at least 1
+         * \param period PHI periods between the expiries after that, at least 1
+         */
+        void start(uint32_t first, uint32_t period) {
+            stop();
+            pio_sm_exec(PHI_TIMER_PIO, sm, pio_encode_jmp(offset));
+            pio_sm_put(PHI_TIMER_PIO, sm, period - 1);
+            pio_sm_put(PHI_TIMER_PIO, sm, first - 1);
+            pio_sm_set_enabled(PHI_TIMER_PIO, sm, true);
+        }
+
+        /*! \brief Get the PHI periods left until the next expiry
+         *
+         * \details Copies X out through the RX FIFO, which the program doesn't
+         * otherwise use. Waits for the push to land before reading the FIFO.
+         * Only valid while the timer is running.
+         */
+        uint32_t remaining() {
+            pio_sm_exec(PHI_TIMER_PIO, sm, pio_encode_mov(pio_isr, pio_x));
+            pio_sm_exec(PHI_TIMER_PIO, sm, pio_encode_push(false, false));
+            while (pio_sm_is_rx_fifo_empty(PHI_TIMER_PIO, sm)) {
+                tight_loop_contents();
+            }
+            return pio_sm_get(PHI_TIMER_PIO, sm) + 1;
+        }
+};
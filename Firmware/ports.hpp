@@ -30,30 +30,193 @@
  *  21             | Videocart 18     | 2102 SRAM
  *  24             | Videocart 10     | 2102 SRAM
  *  25             | Videocart 10     | 2102 SRAM
+ *  FD             | Pico Videocart   | Save slot (menu only, see save_state.hpp)
+ *  FE             | Pico Videocart   | Bank select (banked CHF files only)
+ *  FF             | Pico Videocart   | Launcher (menu only)
  */
 
 #pragma once
 
+#include "channel.hpp"
+#include "chips.hpp"
 #include "default_rom.hpp"
 #include "file_cache.hpp"
 
 inline constexpr uint16_t SRAM_START_ADDR = 0x2800;
-inline bool load_new_game_trigger = false;
 
-/*! \brief Abstract base class for ports 
- * 
- * \details This interface is used by the Videocart emulation code to read and
- * write to I/O ports. New devices can be added by implementing this 
- * interface.
-*/
-class IOPort {
-    public:
-        virtual uint8_t read() = 0;
-        virtual void write(uint8_t) = 0;
+/*! \brief Handlers of an I/O port
+ *
+ * \details Called by ROMC 0x1A/0x1B with the port address. read() drives the
+ * data bus with the value of the port, if it has one.
+ */
+struct PortHandler {
+    void (*read)(uint8_t port);
+    void (*write)(uint8_t port, uint8_t data);
+};
+
+void __not_in_flash_func(port_no_read)(uint8_t port) {}
+void __not_in_flash_func(port_no_write)(uint8_t port, uint8_t data) {}
+
+/*! \brief A mapping from addresses to port handlers
+ *
+ * \details Unused ports have no-op handlers, so a port access is always one
+ * indirect call, with nothing to check first.
+ */
+struct PortTable {
+    PortHandler port[256];
+
+    constexpr PortTable(PortHandler every = {port_no_read, port_no_write}): port() {
+        for (PortHandler &handler : port) {
+            handler = every;
+        }
+    }
 };
 
-/*! \brief A mapping from addresses to I/O ports */
-inline IOPort* IOPorts[256];
+struct DeferredWrite {
+    uint8_t port;
+    uint8_t data;
+};
+
+inline constexpr uint32_t DEFERRED_WRITES_SIZE = 16;
+inline PortTable port_handlers;
+inline SpscRing<DeferredWrite, DEFERRED_WRITES_SIZE> deferred_writes;  // Pushed and popped by core 1, see ports_suspend()
+inline volatile uint32_t ports_generation = 0;     // Incremented by ports_clear() on core 0
+inline volatile uint32_t deferred_generation = 0;  // Generation of the writes in deferred_writes, only written by core 1
+inline volatile bool port_dispatching = false;     // Core 1 is in a port access, only written by core 1
+
+/*! \brief Drop the deferred writes if they were made for a program that's since been unloaded. Runs on core 1 */
+__force_inline bool ports_drop_stale() {
+    if (deferred_generation == ports_generation) {
+        return false;
+    }
+    deferred_generation = ports_generation;
+    DeferredWrite deferred;
+    while (deferred_writes.pop(deferred)) {
+        ; // Meant for the previous program
+    }
+    return true;
+}
+
+/*! \brief Keep a port write made while ports are suspended, to replay it once they aren't */
+void __not_in_flash_func(port_defer_write)(uint8_t port, uint8_t data) {
+    ports_drop_stale();
+    deferred_writes.push({port, data});
+}
+
+/*! \brief Replay the writes made while ports were suspended, in order. Runs on core 1 */
+void __not_in_flash_func(ports_replay)() {
+    if (ports_drop_stale()) {
+        return;
+    }
+    DeferredWrite deferred;
+    while (deferred_writes.pop(deferred)) {
+        port_handlers.port[deferred.port].write(deferred.port, deferred.data);
+    }
+}
+
+inline PortTable suspended_ports({port_no_read, port_defer_write});    // Never changes
+inline PortTable* volatile port_table = &port_handlers;  // The table core 1 uses
+
+/*! \brief Get the table for a port access, and mark core 1 as being in one. Runs on core 1
+ *
+ * \details The mark is made before port_table is read, so once core 0 has
+ * switched tables and seen no mark, every later access uses the new table.
+ * Writes held back while ports were suspended are replayed first.
+ */
+__force_inline PortTable* port_dispatch_begin() {
+    port_dispatching = true;
+    __dmb();
+    PortTable* table = port_table;
+    if (table != &suspended_ports && !deferred_writes.empty()) {
+        ports_replay();
+    }
+    return table;
+}
+
+/*! \brief Mark the end of a port access. Runs on core 1 */
+__force_inline void port_dispatch_end() {
+    __dmb();
+    port_dispatching = false;
+}
+
+/*! \brief Read a port through the current table. Runs on core 1 */
+__force_inline void port_dispatch_read(uint8_t port) {
+    port_dispatch_begin()->port[port].read(port);
+    port_dispatch_end();
+}
+
+/*! \brief Write a port through the current table. Runs on core 1 */
+__force_inline void port_dispatch_write(uint8_t port, uint8_t data) {
+    port_dispatch_begin()->port[port].write(port, data);
+    port_dispatch_end();
+}
+
+template <class Device>
+void port_read(uint8_t port) {
+    drive_dbus(Device::read(port));
+}
+
+template <class Device>
+void port_write(uint8_t port, uint8_t data) {
+    Device::write(port, data);
+}
+
+/*! \brief Attach a device to a port
+ *
+ * \details A device is a class with `static uint8_t read(uint8_t port)` and
+ * `static void write(uint8_t port, uint8_t data)`, with its state in static
+ * members, so nothing is allocated.
+ *
+ * \tparam Device The device
+ * \param port The port address
+ */
+template <class Device>
+void port_attach(uint8_t port) {
+    port_handlers.port[port] = {port_read<Device>, port_write<Device>};
+}
+
+/*! \brief Attach a device to a port that can't be read back, so reads leave the data bus undriven
+ *
+ * \tparam Device The device, whose read() is never called
+ * \param port The port address
+ */
+template <class Device>
+void port_attach_write_only(uint8_t port) {
+    port_handlers.port[port] = {port_no_read, port_write<Device>};
+}
+
+/*! \brief Detach every device, and drop any deferred writes. Must be called from core 0 while core 1 isn't using ports
+ *
+ * \details Only core 1 pops deferred_writes, so the writes are dropped there,
+ * on its next port access.
+ */
+void ports_clear() {
+    port_handlers = PortTable();
+    ports_generation = ports_generation + 1;
+    port_table = &port_handlers;
+}
+
+/*! \brief Make core 1 hold back port I/O, or stop holding it back. Called by core 0
+ *
+ * \details Port handlers run from flash, which can't be read while it's being
+ * written (see flash_cache.hpp), so core 1 is switched to a table of handlers
+ * in RAM in the meantime. Reads give no value, and writes are kept in
+ * deferred_writes (up to DEFERRED_WRITES_SIZE, more are dropped and counted).
+ * Suspending waits for a port access that core 1 had already started to
+ * finish, so no handler is running from flash once it returns. Once ports are
+ * resumed, core 1 replays the writes on its next port access, before the
+ * access itself, so e.g. a Launcher Select made during a flash write still
+ * loads the game.
+ */
+void ports_suspend(bool suspended) {
+    port_table = suspended ? &suspended_ports : &port_handlers;
+    if (suspended) {
+        __dmb();
+        while (port_dispatching) {
+            tight_loop_contents();
+        }
+    }
+}
 
 /*!
  * \brief Implementation of a 2102 SRAM IC
@@ -81,10 +244,8 @@ inline IOPort* IOPorts[256];
  *  0   | RW     | A0
  *
  */
-class Sram2102 : public IOPort {
+class Sram2102 {
     private:
-        uint8_t portIndex;
-        uint16_t address = 0;
         inline static bool sramData[1024];
         inline static uint8_t portA = 0;
         inline static uint8_t portB = 0;
@@ -94,28 +255,48 @@ class Sram2102 : public IOPort {
         static constexpr uint8_t WRITE_FLAG = 0x1;
 
     public:
-        Sram2102(uint8_t portIndex): portIndex(portIndex) {}
+        /*! \brief The memory, one bool per bit, for save states */
+        static bool* memory() {return sramData;}
 
-        uint8_t read() {
-            return portIndex ? portB : portA;
+        // Port A is on the even address, port B on the odd one
+        static uint8_t read(uint8_t port) {
+            return port & 1 ? portB : portA;
         }
 
-        void write(uint8_t data) {
-            if (portIndex) {
+        static void write(uint8_t port, uint8_t data) {
+            if (port & 1) {
                 portB = data;
             } else {
                 portA = data & 0xF;
             }
 
             // Update DATA OUT
-            address = (portA & ADDR_MASK) << 7 | portB;
+            uint16_t address = (portA & ADDR_MASK) << 7 | portB;
             if (portA & WRITE_FLAG) {
                 sramData[address] = portA & IN_FLAG;
+                mark_dirty(DIRTY_SRAM_PAGE + (address >> 8));
             }
             portA = sramData[address] << 7 | portA & ~OUT_FLAG;
         }
 };
 
+inline constexpr uint8_t BANK_SELECT_PORT = 0xFE;
+
+/*! \brief Select the bank of a banked CHF file
+ *
+ * \details Writing N makes bank N visible in place of bank 0, and reading
+ * gives the selected bank. Banks that weren't loaded are ignored. See chips.hpp
+ * for how banks are laid out.
+ */
+class BankSelect {
+    public:
+        static uint8_t read(uint8_t port) {return current_bank;}
+
+        static void write(uint8_t port, uint8_t data) {
+            bank_select(data);
+        }
+};
+
 /*!
  * \brief Communicate SD card contents through a port
  * 
@@ -130,69 +311,260 @@ class Sram2102 : public IOPort {
  * | $02               | Select      | Begin the loading process
  * | $04               | Prev file   | Place next file title in [$2800, $2900)
  * | $08               | None active | No controller buttons are active (needed to ignore repeat $01/$04)
+ * | $10               | Next page   | Move the selection down a page, and place its page in [$2900, $2A00)
+ * | $20               | Prev page   | Move the selection up a page, and place its page in [$2900, $2A00)
+ * | $40               | Jump index  | Select the entry at index [$2A00, $2A01], and place its page in [$2900, $2A00)
+ * | $80               | Jump letter | Select the first entry at or after the letter in $2A00, and place its page in [$2900, $2A00)
+ * 
+ * ### Title Pages
+ *
+ * Entries are grouped into pages of PAGE_TITLES, so the page of entry N is
+ * N / PAGE_TITLES. A page command points [$2900, $2A00) at a TitlePage (see
+ * file_cache.hpp), rather than the menu's own RAM, so it must only be read
+ * while the menu is using pages:
+ *
+ * | Address       | Content
+ * |---------------|--------
+ * | $2900         | 1 once the page is ready, 0 while the Pico is still reading it
+ * | $2901         | Number of titles on the page
+ * | [$2902, $2903]| Number of entries (big endian)
+ * | [$2904, $2905]| Index of the first title on the page (big endian)
+ * | $2906         | Position of the selected entry on the page
+ * | [$2920, $2A00)| The titles, 32 bytes each, null padded
+ *
+ * Core 0 fills the page, and the pages either side of it, ahead of time, so
+ * the next page command usually only has to flip the page pointer. Until a page
+ * is ready, $2900 reads 0 and the menu keeps sending commands (e.g. $08),
+ * each of which checks it again.
  * 
  * ### Loading Process 
  * 
  * | Stage | BIOS         | Menu                       | Pico
  * |-------|--------------|----------------------------|-----
- * | 1     |              | Sends $02 (select) command |
+ * | 1     |              | Sends $02 (select) command | Posts LOAD_GAME to core 0
  * | 2     |              | Jumps to $0000             | Sets $0800 to $00
- * |       |              |                            | Wait until PC0 < $0800
+ * |       |              |                            | Wait for MENU_EXITED (PC0 < $0800), at most MENU_EXIT_TIMEOUT_MS
  * | 3     |              |                            | Disconnect memory
  * |       |              |                            | Rewrite memory, ports, etc.
  * |       |              |                            | Reconnect memory
  * | 4     | Runs program |                            |
  */
-class Launcher : public IOPort {
+class Launcher {
     private:
-        file_info (&file_data)[FOLDER_LIMIT];
         inline static uint8_t previous_command = 0;
         inline static uint8_t command = 0;
+        inline static bool loading = false;        // A LOAD_GAME is waiting for its LOAD_DONE
+        inline static bool select_pending = false; // The LOAD_GAME couldn't be posted yet
+        inline static bool title_pending = false;  // The title wasn't in the directory window yet
+        inline static bool page_pending = false;   // The shown page wasn't filled yet
+        inline static int8_t shown_slot = -1;      // Title page slot in [$2900, $2A00), if any
+        inline static bool fill_posted[PAGE_SLOTS] = {};  // A FILL_PAGE was posted for the slot's page
         static constexpr uint8_t NEXT_FLAG = 0x1;
         static constexpr uint8_t SELECT_FLAG = 0x2;
         static constexpr uint8_t PREV_FLAG = 0x4;
         static constexpr uint8_t NONE_FLAG = 0x8;
+        static constexpr uint8_t NEXT_PAGE = 0x10;
+        static constexpr uint8_t PREV_PAGE = 0x20;
+        static constexpr uint8_t JUMP_INDEX = 0x40;
+        static constexpr uint8_t JUMP_LETTER = 0x80;
+        static constexpr uint16_t TITLE_PAGE_ADDR = SRAM_START_ADDR + 0x100;
+        static constexpr uint16_t ARGUMENT_ADDR = SRAM_START_ADDR + 0x200;
+
+        /*! \brief Place the title of the current file in [$2800, $2900) */
+        static void show_title() {
+            const file_info* entry = directory_entry(file_index);
+            title_pending = entry == nullptr;
+            string_copy((char*)program_rom+SRAM_START_ADDR+2, entry ? entry->title : "Loading...", 32, true, '\0');
+        }
+
+        /*! \brief Point [$2900, $2A00) at a page */
+        static void map_title_page(TitlePage* page) {
+            bank_tables[0].page[TITLE_PAGE_ADDR >> 8] = (uint8_t*) page;
+        }
+
+        /*! \brief Ask core 0 to fill a slot, unless it's filled or was already asked */
+        static void request_fill(int8_t slot) {
+            const TitlePageSlot &held = title_page_slots[slot];
+            if (held.filled != held.number && !fill_posted[slot]) {
+                fill_posted[slot] = post_to_core0({MESSAGE::FILL_PAGE, (uint16_t) slot});
+            }
+        }
+
+        /*! \brief Get the slot holding a page, giving it one if needed
+         *
+         * \details A new page takes a slot that isn't shown and isn't next to
+         * the centre page, so with PAGE_SLOTS of 4 there's always one free.
+         *
+         * \param number The page
+         * \param centre The page about to be shown
+         * \return The slot, or -1 if none were free
+         */
+        static int8_t page_slot(uint16_t number, uint16_t centre) {
+            for (int8_t i = 0; i < PAGE_SLOTS; i++) {
+                if (title_page_slots[i].number == number) {
+                    request_fill(i); // In case the last post was dropped
+                    return i;
+                }
+            }
+            for (int8_t i = 0; i < PAGE_SLOTS; i++) {
+                uint16_t held = title_page_slots[i].number;
+                if (i != shown_slot && (held == PAGE_NONE || held + 1 < centre || held > centre + 1)) {
+                    title_page_slots[i].number = number;
+                    fill_posted[i] = false;
+                    request_fill(i);
+                    return i;
+                }
+            }
+            return -1;
+        }
+
+        /*! \brief Show the shown slot if core 0 has filled it, otherwise the placeholder */
+        static void flip_title_page() {
+            TitlePageSlot &slot = title_page_slots[shown_slot];
+            page_pending = slot.filled != slot.number;
+            if (page_pending) {
+                request_fill(shown_slot);
+            } else {
+                slot.page.selected = file_index - slot.number * PAGE_TITLES;
+            }
+            map_title_page(page_pending ? &title_page_placeholder : &slot.page);
+        }
+
+        /*! \brief Place the page of the current file in [$2900, $2A00), and have the pages either side filled */
+        static void show_page() {
+            uint16_t number = file_index / PAGE_TITLES;
+            int8_t slot = page_slot(number, number);
+            if (slot < 0) {
+                return;
+            }
+            shown_slot = slot;
+            flip_title_page();
+            if (number != 0) {
+                page_slot(number - 1, number);
+            }
+            if ((number + 1) * PAGE_TITLES < directory_size) {
+                page_slot(number + 1, number);
+            }
+        }
+
+        /*! \brief Handle a page command */
+        static void page_command(uint8_t command, uint16_t size) {
+            uint16_t last = size != 0 ? size - 1 : 0;
+            switch (command) {
+                case NEXT_PAGE:
+                    file_index = last - file_index > PAGE_TITLES ? file_index + PAGE_TITLES : last;
+                    break;
+                case PREV_PAGE:
+                    file_index = file_index > PAGE_TITLES ? file_index - PAGE_TITLES : 0;
+                    break;
+                case JUMP_INDEX: {
+                    uint16_t index = program_rom[ARGUMENT_ADDR] << 8 | program_rom[ARGUMENT_ADDR + 1];
+                    file_index = index < last ? index : last;
+                    break;
+                }
+                case JUMP_LETTER:
+                    if (!post_to_core0({MESSAGE::FIND_LETTER, program_rom[ARGUMENT_ADDR]})) {
+                        break; // Stay on the current page, the menu can send it again
+                    }
+                    map_title_page(&title_page_placeholder);
+                    page_pending = false;
+                    return; // Shown once core 0 replies
+                default:
+                    return;
+            }
+            show_page();
+        }
+
+        /*! \brief Post the selected file to core 0, or leave it to be posted on the next write */
+        static void post_select() {
+            loading = post_to_core0({MESSAGE::LOAD_GAME, file_index});
+            select_pending = !loading;
+        }
 
     public:
         inline static uint16_t file_index = 0;
+        inline static volatile uint32_t commands = 0;  // Changes of command, so core 0 can tell the menu is in use
 
-        Launcher(file_info (&file_data)[FOLDER_LIMIT]): file_data(file_data) {
+        /*! \brief Forget the last command and every page, before the menu starts */
+        static void reset() {
             previous_command = 0;
+            select_pending = false;
+            shown_slot = -1;
+            page_pending = false;
+            for (bool &posted : fill_posted) {
+                posted = false;
+            }
+            title_pages_reset();
         }
 
-        uint8_t read() {return 0xFF;}
+        static uint8_t read(uint8_t port) {return 0xFF;}
+
+        static void write(uint8_t port, uint8_t command) {
+            Message message;
+            bool letter_found = false;
+            while (core0_to_core1.pop(message)) {
+                if (message.type == MESSAGE::LOAD_DONE) {
+                    loading = false;
+                } else if (message.type == MESSAGE::LETTER_FOUND) {
+                    file_index = message.argument;
+                    letter_found = true;
+                }
+            }
+
+            uint16_t size = directory_size;
+            if (size != 0 && file_index >= size) {
+                file_index = size - 1; // The index was rebuilt with fewer entries
+            }
+            if (letter_found) {
+                show_page();
+            }
+            if (select_pending) {
+                post_select();
+            }
 
-        void write(uint8_t command) {
             if (command != previous_command) {
-                if (DIR_LIMIT == 0) {
-                    string_copy((char*)program_rom+SRAM_START_ADDR+2, (char*)"No Data", 32, true, '\0');
+                commands = commands + 1;
+                if (command >= NEXT_PAGE) {
+                    page_command(command, size);
+                } else if (size == 0) {
+                    string_copy((char*)program_rom+SRAM_START_ADDR+2, "No Data", 32, true, '\0');
                 } else {
                     switch (command) {
                         case NEXT_FLAG:
-                            if (file_index != DIR_LIMIT - 1) {
+                            if (file_index != size - 1) {
                                 file_index++;
                             }
-                            string_copy((char*)program_rom+SRAM_START_ADDR+2, file_data[file_index].title, 32, true, '\0');
+                            show_title();
                             break;
                         case PREV_FLAG:
                             if (file_index != 0) {
                                 file_index--;
                             }
-                            string_copy((char*)program_rom+SRAM_START_ADDR+2, file_data[file_index].title, 32, true, '\0');
+                            show_title();
                             break;
-                        case SELECT_FLAG:
-                            if (file_data[file_index].isFile) {
-                                load_new_game_trigger = true; // FIXME: talk to core 0 through the stack instead
+                        case SELECT_FLAG: {
+                            const file_info* entry = directory_entry(file_index);
+                            if (entry != nullptr && entry->isFile && !loading && !select_pending) {
+                                post_select();
                             }
                             break;
+                        }
                         case NONE_FLAG:
                             if (previous_command == 0) {
-                                string_copy((char*)program_rom+SRAM_START_ADDR+2, file_data[file_index].title, 32, true, '\0');
+                                show_title();
                             }
                             break;
                     }
                 }
+                if (size != 0) {
+                    directory_prefetch(file_index);
+                }
+            } else if (title_pending && directory_entry(file_index) != nullptr) {
+                show_title();
+            }
+            if (page_pending) {
+                flip_title_page();
             }
             previous_command = command;
         }
-};
\ No newline at end of file
+};
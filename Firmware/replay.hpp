@@ -0,0 +1,175 @@
+/** \file replay.hpp
+ *
+ * \brief Replays a recorded bus trace through execute_romc(), to check changes to the bus path
+ *
+ * \details A trace recorded with BUS_TRACE (see trace.hpp) holds the ROMC code,
+ * data bus and registers of every cycle. With TRACE_REPLAY set in config.hpp,
+ * core 1 feeds the cycles of REPLAY_PATH back through execute_romc() in place
+ * of the bus loop, and checks that PC0 and DC0 after each cycle match the next
+ * record. A build that changes the bus path can then be checked against a
+ * trace recorded with a build that was known to work, without a console, and
+ * the time spent in execute_romc() gives its throughput against real time.
+ *
+ * 1. Record a trace from power on with the default trigger, and copy
+ *    /.pvctrace to REPLAY_PATH.
+ * 2. Copy the game that was running to REPLAY_ROM_PATH (any format load_game()
+ *    takes). Without it, the menu is replayed against itself.
+ * 3. Build with TRACE_REPLAY. Core 0 loads the game, then streams the trace
+ *    to core 1 through replay_records, and prints the report over USB serial.
+ *
+ * Gaps in the trace (records dropped while recording, or a trigger that
+ * stopped and started again) can't be checked across, so the registers are
+ * reloaded from the record after a gap, and after each mismatch, so one
+ * difference doesn't hide the next. PC1 and DC1 aren't recorded, so a
+ * difference in them shows up when they're next copied into PC0 or DC0.
+ *
+ * As with the ROMC benchmark, the data bus pins are driven, so the Pico must
+ * not be plugged into a console.
+ */
+
+#pragma once
+
+#include "benchmark.hpp"
+#include "config.hpp"
+#include "loader.hpp"
+#include "ring.hpp"
+#include "romc.hpp"
+#include "timing.hpp"
+#include "trace.hpp"
+
+#include <SD.h>
+
+inline constexpr const char* REPLAY_PATH = "/.pvcreplay";          // A trace file, as written by trace_drain()
+inline constexpr const char* REPLAY_ROM_PATH = "/.pvcreplay.rom";  // The game the trace was recorded with
+inline constexpr uint32_t REPLAY_RING_SIZE = 1024;
+inline constexpr uint8_t REPLAY_MISMATCH_LIMIT = 8;  // Mismatches kept for the report
+
+struct ReplayMismatch {
+    uint32_t record;
+    uint8_t romc;
+    uint8_t dbus;
+    uint16_t expected_pc0;
+    uint16_t pc0;
+    uint16_t expected_dc0;
+    uint16_t dc0;
+};
+
+struct ReplayStats {
+    uint32_t records;     // Records executed
+    uint32_t checked;     // Records whose registers were compared
+    uint32_t gaps;        // Records that didn't follow on from the one before
+    uint32_t mismatches;
+    uint64_t cycles;      // SysTick cycles spent in execute_romc()
+    uint32_t us;          // Time from the first record to the last, including waiting for the SD card
+    ReplayMismatch first_mismatches[REPLAY_MISMATCH_LIMIT];
+};
+
+inline SpscRing<TraceRecord, REPLAY_RING_SIZE> replay_records;  // Pushed by core 0, popped by core 1
+inline ReplayStats replay_stats = {};
+inline volatile bool replay_loaded = false;  // Core 0 has pushed the last record
+inline volatile bool replay_done = false;    // Core 1 has executed it
+
+/*! \brief Execute every record of the trace, checking the registers after each. Runs on core 1 in place of the bus loop */
+void run_trace_replay() {
+    cycle_counter_init();
+    ReplayStats &stats = replay_stats;
+    TraceRecord record;
+    uint16_t next_cycle = 0;
+    uint32_t start_us = 0;
+    while (!replay_loaded || !replay_records.empty()) {
+        if (!replay_records.pop(record)) {
+            continue;
+        }
+        if (stats.records == 0) {
+            start_us = time_us_32();
+        }
+
+        if (stats.records != 0 && record.cycle == next_cycle) {
+            stats.checked++;
+            if (pc0 != record.pc0 || dc0 != record.dc0) {
+                if (stats.mismatches < REPLAY_MISMATCH_LIMIT) {
+                    stats.first_mismatches[stats.mismatches] = {stats.records, romc, dbus, record.pc0, pc0, record.dc0, dc0};
+                }
+                stats.mismatches++;
+                pc0 = record.pc0;
+                dc0 = record.dc0;
+            }
+        } else {
+            stats.gaps += stats.records != 0;
+            pc0 = record.pc0;
+            dc0 = record.dc0;
+        }
+
+        romc = record.romc;
+        dbus = record.dbus;
+        if constexpr (SPECULATIVE_FETCH) {
+            prefetch_romc();
+        }
+        uint32_t start = cycle_count();
+        execute_romc();
+        stats.cycles += cycles_elapsed(start, cycle_count());
+        next_cycle = record.cycle + 1;
+        stats.records++;
+    }
+    stats.us = time_us_32() - start_us;
+    replay_done = true;
+}
+
+/*! \brief Load the game and stream the trace to core 1. Must be called from core 0, until replay_loaded is set */
+void replay_feed() {
+    static File trace_file;
+    static bool started = false;
+    static struct __attribute__((packed)) {
+        TraceBlockHeader header;
+        TraceRecord records[TRACE_BLOCK_RECORDS];
+    } block;
+    static uint16_t next = 0;   // Next record of the block to push
+    static uint16_t count = 0;  // Records in the block
+
+    if (!started) {
+        started = true;
+        File rom = SD.open(REPLAY_ROM_PATH, FILE_READ);
+        if (rom) {
+            load_game(rom);
+        }
+        trace_file = SD.open(REPLAY_PATH, FILE_READ);
+    }
+
+    while (next < count) {
+        if (!replay_records.push(block.records[next])) {
+            return; // Full, try again on the next call
+        }
+        next++;
+    }
+
+    const TraceBlockHeader &header = block.header;
+    bool valid = trace_file && trace_file.read((uint8_t*) &block.header, sizeof(header)) == sizeof(header)
+                 && header.magic == TRACE_MAGIC && header.record_size == sizeof(TraceRecord) && header.count <= TRACE_BLOCK_RECORDS;
+    size_t size = valid ? header.count * sizeof(TraceRecord) : 0;
+    if (!valid || trace_file.read((uint8_t*) block.records, size) != size) {
+        trace_file.close();
+        replay_loaded = true;
+        return;
+    }
+    next = 0;
+    count = header.count;
+}
+
+/*! \brief Print the result of the replay
+ *
+ * \param out Where to print the report (e.g. Serial)
+ */
+void print_replay(Print &out) {
+    const ReplayStats &stats = replay_stats;
+    uint32_t mean_ns = stats.records ? cycles_to_ns(stats.cycles) / stats.records : 0;
+    out.printf("Trace replay @ %lu MHz: %lu records, %lu checked, %lu gaps, %lu mismatches\n", clock_get_hz(clk_sys) / 1000000,
+               stats.records, stats.checked, stats.gaps, stats.mismatches);
+    out.printf("execute_romc(): mean %lu ns per cycle, %lux a %lu ns bus cycle; whole replay %lu us\n", mean_ns,
+               mean_ns ? BUS_CYCLE_NS / mean_ns : 0, BUS_CYCLE_NS, stats.us);
+    for (uint8_t i = 0; i < min(stats.mismatches, (uint32_t) REPLAY_MISMATCH_LIMIT); i++) {
+        const ReplayMismatch &m = stats.first_mismatches[i];
+        out.printf("Mismatch after record %lu (ROMC 0x%02X, DBUS %02X): PC0 %04X expected %04X, DC0 %04X expected %04X\n",
+                   m.record - 1, m.romc, m.dbus, m.pc0, m.expected_pc0, m.dc0, m.expected_dc0);
+    }
+    out.printf(stats.mismatches == 0 && stats.checked != 0 ? "PASS\n" : "FAIL\n");
+}
@@ -0,0 +1,72 @@
+/** \file ring.hpp
+ *
+ * \brief Lock-free single-producer, single-consumer ring buffer
+ *
+ * \details Used to pass data from core 1 to core 0 without either core ever
+ * waiting on the other. Only one core may push and only the other may pop.
+ * The producer owns `head`, the consumer owns `tail`, and each only reads the
+ * other's index, so no locks or atomic read-modify-writes are needed (the
+ * Cortex-M0+ has none anyway).
+ *
+ * When the ring is full, push() drops the entry and counts it, so the
+ * producer's cost is bounded.
+ */
+
+#pragma once
+
+#include <hardware/sync.h>
+
+template <typename T, uint32_t Size>
+class SpscRing {
+    static_assert((Size & (Size - 1)) == 0, "Size must be a power of 2");
+
+    private:
+        T entries[Size];
+        volatile uint32_t head = 0;  // Next entry to write, only written by the producer
+        volatile uint32_t tail = 0;  // Next entry to read, only written by the consumer
+
+    public:
+        uint32_t high_water = 0;     // Most entries ever waiting, updated by the producer
+        uint32_t dropped = 0;        // Entries pushed while the ring was full, updated by the producer
+
+        /*! \brief Add an entry (producer only)
+         *
+         * \param entry The entry to add
+         * \return false if the ring was full and the entry was dropped
+         */
+        __force_inline bool push(const T &entry) {
+            uint32_t h = head;
+            uint32_t used = h - tail;
+            if (used == Size) {
+                dropped++;
+                return false;
+            }
+            entries[h & (Size - 1)] = entry;
+            __dmb();                 // Entry must be visible before the new head
+            head = h + 1;
+            high_water = used >= high_water ? used + 1 : high_water;
+            return true;
+        }
+
+        /*! \brief Remove the oldest entry (consumer only)
+         *
+         * \param entry Where to put the entry
+         * \return false if the ring was empty
+         */
+        __force_inline bool pop(T &entry) {
+            uint32_t t = tail;
+            if (t == head) {
+                return false;
+            }
+            __dmb();                 // Don't read the entry before the head that published it
+            entry = entries[t & (Size - 1)];
+            __dmb();                 // Finish reading the entry before handing the slot back
+            tail = t + 1;
+            return true;
+        }
+
+        /*! \brief Check if there is anything to pop */
+        __force_inline bool empty() const {
+            return head == tail;
+        }
+};
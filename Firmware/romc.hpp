@@ -11,9 +11,13 @@
  * Refer to the 3853 SMI datasheet for more information.
  */
 
+#pragma once
+
 #include "chips.hpp"
+#include "config.hpp"
 #include "gpio.hpp"
 #include "ports.hpp"
+#include "interrupts.hpp"
 
 inline uint8_t romc = 0x1C; // IDLE
 inline uint8_t dbus = 0x00;
@@ -24,8 +28,141 @@ inline uint16_t dc1 = 0x00;
 inline uint16_t tmp;
 inline uint8_t io_address;
 
-/*! \brief Process ROMC instructions */
-__force_inline void execute_romc() { 
+/*! \brief What a register will put on the data bus, worked out ahead of time
+ *
+ * \details Filled in by prefetch_romc() while WRITE is low. The registers only
+ * change in execute_romc(), so at the next rising edge these are exact.
+ */
+struct RegisterPrefetch {
+    uint8_t value;  // Memory byte at the register's address
+    bool owned;     // The address is within the Videocart address space
+};
+
+inline RegisterPrefetch prefetch_pc0;
+inline RegisterPrefetch prefetch_pc1;
+inline RegisterPrefetch prefetch_dc0;
+inline uint32_t prefetch_count = 0;  // Cycles that were prefetched
+inline uint32_t prefetch_hits = 0;   // Memory fetches served from a prefetch, counted for ROMC_BENCHMARK and SERIAL_DIAGNOSTICS
+
+namespace DRIVE {
+    inline constexpr uint8_t NONE = 0;      // The Videocart never drives the data bus
+    inline constexpr uint8_t MEMORY = 1;    // Drive the memory byte at the address source
+    inline constexpr uint8_t REGISTER = 2;  // Drive a byte of the address source itself
+}
+
+/*! \brief Bus behaviour of a ROMC code
+ *
+ * \details Whether the Videocart drives the data bus, which register decides
+ * if the address is ours, and what is driven. For REGISTER, the value driven
+ * is the address source shifted right by `shift`.
+ */
+struct RomcAction {
+    uint16_t* source;
+    RegisterPrefetch* prefetch;
+    uint8_t drive;
+    uint8_t shift;
+};
+
+/*! \brief Bus behaviour of each ROMC code, indexed by ROMC value
+ *
+ * \details Kept in SRAM so the lookup never waits on flash. ROMC 0x1B also
+ * drives the bus, but through the I/O ports rather than an address, so it is
+ * handled alongside the register updates.
+ */
+inline RomcAction romc_actions[32] = {
+    {&pc0, &prefetch_pc0, DRIVE::MEMORY, 0},   // 0x00
+    {&pc0, &prefetch_pc0, DRIVE::MEMORY, 0},   // 0x01
+    {&dc0, &prefetch_dc0, DRIVE::MEMORY, 0},   // 0x02
+    {&pc0, &prefetch_pc0, DRIVE::MEMORY, 0},   // 0x03
+    {&pc0, &prefetch_pc0, DRIVE::NONE, 0},     // 0x04
+    {&dc0, &prefetch_dc0, DRIVE::NONE, 0},     // 0x05
+    {&dc0, &prefetch_dc0, DRIVE::REGISTER, 8}, // 0x06
+    {&pc1, &prefetch_pc1, DRIVE::REGISTER, 8}, // 0x07
+    {&pc0, &prefetch_pc0, DRIVE::NONE, 0},     // 0x08
+    {&dc0, &prefetch_dc0, DRIVE::REGISTER, 0}, // 0x09
+    {&dc0, &prefetch_dc0, DRIVE::NONE, 0},     // 0x0A
+    {&pc1, &prefetch_pc1, DRIVE::REGISTER, 0}, // 0x0B
+    {&pc0, &prefetch_pc0, DRIVE::MEMORY, 0},   // 0x0C
+    {&pc0, &prefetch_pc0, DRIVE::NONE, 0},     // 0x0D
+    {&pc0, &prefetch_pc0, DRIVE::MEMORY, 0},   // 0x0E
+    {&pc0, &prefetch_pc0, DRIVE::NONE, 0},     // 0x0F
+    {&pc0, &prefetch_pc0, DRIVE::NONE, 0},     // 0x10
+    {&pc0, &prefetch_pc0, DRIVE::MEMORY, 0},   // 0x11
+    {&pc0, &prefetch_pc0, DRIVE::NONE, 0},     // 0x12
+    {&pc0, &prefetch_pc0, DRIVE::NONE, 0},     // 0x13
+    {&pc0, &prefetch_pc0, DRIVE::NONE, 0},     // 0x14
+    {&pc1, &prefetch_pc1, DRIVE::NONE, 0},     // 0x15
+    {&dc0, &prefetch_dc0, DRIVE::NONE, 0},     // 0x16
+    {&pc0, &prefetch_pc0, DRIVE::NONE, 0},     // 0x17
+    {&pc1, &prefetch_pc1, DRIVE::NONE, 0},     // 0x18
+    {&dc0, &prefetch_dc0, DRIVE::NONE, 0},     // 0x19
+    {&pc0, &prefetch_pc0, DRIVE::NONE, 0},     // 0x1A
+    {&pc0, &prefetch_pc0, DRIVE::NONE, 0},     // 0x1B
+    {&pc0, &prefetch_pc0, DRIVE::NONE, 0},     // 0x1C
+    {&dc0, &prefetch_dc0, DRIVE::NONE, 0},     // 0x1D
+    {&pc0, &prefetch_pc0, DRIVE::REGISTER, 0}, // 0x1E
+    {&pc0, &prefetch_pc0, DRIVE::REGISTER, 8}, // 0x1F
+};
+
+/*! \brief Work out the data bus candidates for the next cycle
+ *
+ * \details Called while waiting for the rising edge of WRITE, when core 1
+ * would otherwise be idle. It reads the memory bytes addressed by PC0 and DC0
+ * and checks which registers point into the Videocart, so a fetch only has to
+ * pick one and drive it.
+ */
+__force_inline void prefetch_romc() {
+    prefetch_pc0.value = read_program_byte(pc0);
+    prefetch_pc0.owned = is_cart_address(pc0);
+    prefetch_dc0.value = read_program_byte(dc0);
+    prefetch_dc0.owned = is_cart_address(dc0);
+    prefetch_pc1.owned = is_cart_address(pc1);
+    prefetch_count++;
+}
+
+/*! \brief Drive the data bus for the current ROMC code, from romc_actions
+ *
+ * \tparam speculative Drive from the values of prefetch_romc(), which must have
+ * been called since the previous cycle
+ * \return The value for the data bus, whether or not it was driven
+ */
+template <bool speculative = SPECULATIVE_FETCH>
+__force_inline uint8_t drive_romc() {
+    const RomcAction action = romc_actions[romc];
+    uint8_t value = 0;
+    if (action.drive != DRIVE::NONE) {
+        if constexpr (speculative) {
+            value = action.drive == DRIVE::MEMORY ? action.prefetch->value : *action.source >> action.shift;
+            if (action.prefetch->owned) {
+                drive_dbus(value);
+            }
+            if constexpr (ROMC_BENCHMARK || SERIAL_DIAGNOSTICS) {
+                prefetch_hits += action.drive == DRIVE::MEMORY; // Kept off the bus path unless it's reported
+            }
+        } else {
+            uint16_t address = *action.source;
+            value = action.drive == DRIVE::MEMORY ? read_program_byte(address) : address >> action.shift;
+            if (is_cart_address(address)) {
+                drive_dbus(value);
+            }
+        }
+    }
+    return value;
+}
+
+/*! \brief Process ROMC instructions
+ *
+ * \details The data bus is driven first, by drive_romc(), so that the path
+ * from the rising edge to valid data is the same short sequence for every ROMC
+ * code. The switch below then only updates the registers.
+ *
+ * \tparam speculative Drive from the values of prefetch_romc(), which must have
+ * been called since the previous cycle
+ */
+template <bool speculative = SPECULATIVE_FETCH>
+__force_inline void execute_romc() {
+    uint8_t value = drive_romc<speculative>();
+
     switch (romc) {
         case 0x00:
             /*
@@ -34,7 +171,6 @@ __force_inline void execute_romc() {
              * code addressed by PC0; then all devices increment the contents
              * of PC0.
              */
-            write_dbus(read_program_byte(pc0), pc0);
             pc0 += 1;
             break;
         case 0x01:
@@ -44,7 +180,6 @@ __force_inline void execute_romc() {
              * location addressed by PC0; then all devices add the 8-bit value
              * on the data bus as signed binary number to PC0.
              */
-            write_dbus(read_program_byte(pc0), pc0);
             pc0 += (int8_t) dbus;
             break;
         case 0x02:
@@ -54,7 +189,6 @@ __force_inline void execute_romc() {
              * the memory location addressed by DC0; then all devices increment
              * DC0.
              */
-            write_dbus(read_program_byte(dc0), dc0);
             dc0 += 1;
             break;
         case 0x03:
@@ -62,7 +196,7 @@ __force_inline void execute_romc() {
              * Similar to 0x00, except that it is used for immediate operands
              * fetches (using PC0) instead of instruction fetches.
              */
-            write_dbus(io_address = read_program_byte(pc0), pc0);
+            io_address = value;
             pc0 += 1;
             break;
         case 0x04:
@@ -88,7 +222,6 @@ __force_inline void execute_romc() {
              * Note: Assumed to only apply to the device whose address space 
              * includes the contents of the DC0 register
              */
-            write_dbus(dc0 >> 8, dc0);
             break;
         case 0x07:
             /*
@@ -97,7 +230,6 @@ __force_inline void execute_romc() {
              * Note: Assumed to only apply to the device whose address space 
              * includes the contents of the PC1 register
              */
-            write_dbus(pc1 >> 8, pc1);
             break;
         case 0x08:
             /*
@@ -115,7 +247,6 @@ __force_inline void execute_romc() {
              * The device whose address space includes the contents of the DC0
              * register must place the low order byte of DC0 onto the data bus.
              */
-            write_dbus(dc0 & 0xff, dc0);
             break;
         case 0x0A:
             /*
@@ -129,7 +260,6 @@ __force_inline void execute_romc() {
              * The device whose address space includes the value in PC1
              * must place the low order byte of PC1 onto the data bus.
              */
-            write_dbus(pc1 & 0xff, pc1);
             break;
         case 0x0C:
             /*
@@ -138,7 +268,6 @@ __force_inline void execute_romc() {
              * by PC0 into the data bus; then all devices move the value that
              * has just been placed on the data bus into the low order byte of PC0.
              */
-            write_dbus(read_program_byte(pc0), pc0);
             pc0 = (pc0 & 0xff00) | dbus;
             break;
         case 0x0D:
@@ -155,7 +284,6 @@ __force_inline void execute_romc() {
              * The value on the data bus is then moved to the low order byte
              * of DC0 by all devices.
              */
-            write_dbus(read_program_byte(pc0), pc0);
             dc0 = (dc0 & 0xff00) | dbus;
             break;
         case 0x0F:
@@ -166,7 +294,7 @@ __force_inline void execute_romc() {
              * must move the contents of the data bus into the low order
              * byte of PC0.
              */
-            // TODO: ROMC 0x0F
+            interrupt_acknowledge_low();
             pc1 = pc0;
             pc0 = (pc0 & 0xff00) | dbus;
             break;
@@ -193,7 +321,6 @@ __force_inline void execute_romc() {
              * data bus. All devices must then move the contents of the
              * data bus to the upper byte of DC0.
              */
-            write_dbus(read_program_byte(pc0), pc0);
             dc0 = (dc0 & 0x00ff) | (dbus << 8);
             break;
         case 0x12:
@@ -213,7 +340,7 @@ __force_inline void execute_romc() {
              * (so that it is no longer requesting CPU servicing and can respond
              * to another interrupt).
              */
-            // TODO: ROMC 0x13
+            interrupt_acknowledge_high();
             pc0 = (pc0 & 0x00ff) | (dbus << 8);
             break;
         case 0x14:
@@ -264,9 +391,7 @@ __force_inline void execute_romc() {
              * register was addressed; the device containing the addressed port
              * must place the contents of the data bus into the address port.
              */
-            if (IOPorts[io_address] != nullptr) {
-                IOPorts[io_address]->write(dbus);
-            }
+            port_dispatch_write(io_address, dbus);
             break;
         case 0x1B:
             /*
@@ -276,9 +401,7 @@ __force_inline void execute_romc() {
              * contents of timer and interrupt control registers cannot be read
              * back onto the data bus).
              */
-            if (IOPorts[io_address] != nullptr) {
-                write_dbus(IOPorts[io_address]->read(), VIDEOCART_START_ADDR);
-            }
+            port_dispatch_read(io_address);
             break;
         case 0x1C:
             /*
@@ -306,14 +429,12 @@ __force_inline void execute_romc() {
              * The devices whose address space includes the contents of PC0
              * must place the low order byte of PC0 onto the data bus.
              */
-            write_dbus(pc0 & 0xff, pc0);
             break;
         case 0x1F:
             /*
              * The devices whose address space includes the contents of PC0
              * must place the high order byte of PC0 onto the data bus.
              */
-            write_dbus((pc0 >> 8) & 0xff, pc0);
             break;
       }
 }
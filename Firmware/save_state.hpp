@@ -0,0 +1,289 @@
+/** \file save_state.hpp
+ *
+ * \brief Snapshots of a game's RAM, saved while it runs and restored when it's loaded again
+ *
+ * \details With SAVE_STATES set in config.hpp, core 1 marks each 256-byte page
+ * it writes to in dirty_pages (see chips.hpp), for RAM_CT regions and the 2102
+ * SRAM. Every SAVE_PERIOD_MS, save_step() on core 0 appends the pages marked
+ * since the last snapshot to the game's save file, so a snapshot is the size of
+ * what the game changed rather than of its whole address space. A page is
+ * unmarked before it's copied, so a write while it's being copied marks it
+ * again, and it goes into the next snapshot.
+ *
+ * Each game has SAVE_SLOTS save files, `/.pvcsave-<hash of the file
+ * name>-<slot>`, kept out of the menu by their name. The menu selects the slot
+ * used by the next game loaded through the SaveControl port, and whether the
+ * slot's last save is restored, or the game starts afresh and overwrites it.
+ * The slot is kept from one game to the next, the restore request is only used
+ * once. A save file is a series of blocks:
+ *
+ * | Field    | Size   | Meaning
+ * |----------|--------|--------
+ * | magic    | 4      | "PVSS"
+ * | count    | 2      | Pages in the block
+ * | bank     | 1      | Selected bank (see chips.hpp)
+ * | reserved | 1      |
+ * | sequence | 4      | Snapshot number
+ * | pages    | 258n   | Page number (2 bytes, little endian), then the page
+ *
+ * The first block holds every saved page. Once the file is longer than
+ * SAVE_COMPACT_FACTOR full snapshots, it's started again with a full one.
+ *
+ * When a restore was requested, save_begin() replays the file over the newly
+ * loaded game, during the load window before LOAD_DONE is sent, and stops at
+ * the first block or page cut short (e.g. by power loss). A bad snapshot can
+ * then be avoided by starting the game without restoring it, or from another
+ * slot.
+ *
+ * Only the state outside the console can be saved: the registers and
+ * scratchpad of the F3850 aren't visible on the bus, so a restored game starts
+ * again from the BIOS with its RAM as it was, rather than at the same
+ * instruction. Banked RAM is saved as seen through the selected bank. NVRAM_CT
+ * regions are already kept in FRAM (see fram.hpp), so they aren't marked.
+ */
+
+#pragma once
+
+#include "chips.hpp"
+#include "config.hpp"
+#include "file_cache.hpp"
+#include "ports.hpp"
+
+#include <SD.h>
+
+inline constexpr uint32_t SAVE_MAGIC = 0x53535650;  // "PVSS"
+inline constexpr uint32_t SAVE_PERIOD_MS = 2000;
+inline constexpr uint8_t SAVE_SLOTS = 4;
+inline constexpr uint8_t SAVE_COMPACT_FACTOR = 4;
+inline constexpr uint16_t SAVE_PAGE_SIZE = 0x100;
+inline constexpr uint8_t SAVE_CONTROL_PORT = 0xFD;
+
+namespace SAVE_CONTROL {
+    inline constexpr uint8_t SLOT_MASK = 0x3;
+    inline constexpr uint8_t RESTORE = 0x80;
+}
+
+static_assert(SAVE_CONTROL::SLOT_MASK == SAVE_SLOTS - 1, "Every slot must be selectable");
+
+static_assert(sizeof(bool) == 1, "The 2102 SRAM is saved as bytes");
+
+struct __attribute__((packed)) SaveBlockHeader {
+    uint32_t magic;
+    uint16_t count;
+    uint8_t bank;
+    uint8_t reserved;
+    uint32_t sequence;
+};
+
+struct SaveState {
+    File file;
+    bool active = false;
+    char path[32];
+    bool saved[DIRTY_PAGES];  // Pages the game has RAM in
+    uint16_t page_count;
+    uint32_t sequence;
+    uint32_t last_ms;
+};
+
+struct SaveStats {
+    uint32_t snapshots;
+    uint16_t last_pages;      // Pages in the last snapshot
+    uint32_t last_bytes;
+    uint32_t last_us;
+    uint32_t max_us;          // Slowest snapshot
+    uint16_t restored_pages;  // Pages written by the last restore
+    uint32_t restore_us;
+};
+
+inline SaveState save_state;
+inline SaveStats save_stats = {};
+inline volatile uint8_t save_slot = 0;                // Slot used by the next game loaded
+inline volatile bool save_restore_requested = false;  // Restore the slot when the next game is loaded
+
+/*! \brief Select the save slot of the next game loaded, from the menu
+ *
+ * \details Only attached to the menu, and only with SAVE_STATES. Reading
+ * gives the value last written.
+ *
+ *  Bits | Meaning
+ *  -----|--------
+ *  0-1  | Save slot
+ *  7    | Restore the slot's last save, rather than starting the game afresh
+ */
+class SaveControl {
+    public:
+        static uint8_t read(uint8_t port) {
+            return save_slot | (save_restore_requested ? SAVE_CONTROL::RESTORE : 0);
+        }
+
+        static void write(uint8_t port, uint8_t data) {
+            save_slot = data & SAVE_CONTROL::SLOT_MASK;
+            save_restore_requested = data & SAVE_CONTROL::RESTORE;
+        }
+};
+
+/*! \brief Get where a page is kept in RAM
+ *
+ * \param page A memory page (address >> 8), or a page from DIRTY_SRAM_PAGE on
+ * \return The page
+ */
+uint8_t* save_page_data(uint16_t page) {
+    if (page >= DIRTY_SRAM_PAGE) {
+        return (uint8_t*) Sram2102::memory() + (page - DIRTY_SRAM_PAGE) * SAVE_PAGE_SIZE;
+    }
+    return &program_byte(page << 8);
+}
+
+/*! \brief Get the size of a block of every saved page */
+uint32_t save_full_size() {
+    return sizeof(SaveBlockHeader) + save_state.page_count * (sizeof(uint16_t) + SAVE_PAGE_SIZE);
+}
+
+/*! \brief Read the save file into memory
+ *
+ * \return The pages restored
+ */
+uint16_t save_restore() {
+    File file = SD.open(save_state.path, FILE_READ);
+    if (!file) {
+        return 0;
+    }
+    uint16_t restored = 0;
+    SaveBlockHeader header;
+    while (file.read((uint8_t*) &header, sizeof(header)) == sizeof(header) && header.magic == SAVE_MAGIC) {
+        for (uint16_t i = 0; i < header.count; i++) {
+            static uint8_t data[SAVE_PAGE_SIZE];
+            uint16_t page;
+            if (file.read((uint8_t*) &page, sizeof(page)) != sizeof(page) || file.read(data, sizeof(data)) != sizeof(data)) {
+                file.close();
+                return restored;
+            }
+            if (page < DIRTY_PAGES && save_state.saved[page]) {
+                memcpy(save_page_data(page), data, sizeof(data));
+                restored++;
+            }
+        }
+        bank_select(header.bank);
+        save_state.sequence = header.sequence + 1;
+    }
+    file.close();
+    return restored;
+}
+
+/*! \brief Start saving the game that was just loaded, restoring its last save. Must be called from core 0
+ *
+ * \param name The file name of the game
+ */
+void save_begin(const char* name) {
+    uint32_t start_us = time_us_32();
+    uint32_t hash = SIGNATURE_SEED;
+    for (const char* c = name; *c != '\0'; c++) {
+        hash = (hash ^ (uint8_t) *c) * 16777619u;
+    }
+    snprintf(save_state.path, sizeof(save_state.path), "/.pvcsave-%08lX-%u", hash, (uint8_t) save_slot);
+
+    // Pages with any RAM, and the 2102 if it's attached
+    save_state.page_count = 0;
+    for (uint16_t page = 0; page < DIRTY_PAGES; page++) {
+        bool saved = false;
+        if (page >= DIRTY_SRAM_PAGE) {
+            saved = port_handlers.port[0x20].write == port_write<Sram2102>;
+        } else {
+            for (uint16_t offset = 0; offset < SAVE_PAGE_SIZE && !saved; offset++) {
+                saved = chip_type_at(page << 8 | offset) == RAM_CT::id;
+            }
+        }
+        save_state.saved[page] = saved;
+        save_state.page_count += saved;
+    }
+    if (save_state.page_count == 0) {
+        return;
+    }
+
+    save_state.sequence = 0;
+    bool restore = save_restore_requested;
+    save_restore_requested = false;
+    save_stats.restored_pages = restore ? save_restore() : 0;
+    save_stats.restore_us = time_us_32() - start_us;
+
+    // The first snapshot holds every page, unless the file already starts with one and is kept
+    bool full = save_stats.restored_pages == 0;
+    for (uint16_t page = 0; page < DIRTY_PAGES; page++) {
+        dirty_pages[page] = full && save_state.saved[page];
+    }
+    save_state.file = full ? create_file(save_state.path) : SD.open(save_state.path, FILE_WRITE);
+    save_state.last_ms = millis();
+    save_state.active = save_state.file;
+}
+
+/*! \brief Stop saving, for the next game. Must be called from core 0 */
+void save_end() {
+    if (save_state.active) {
+        save_state.file.close();
+        save_state.active = false;
+    }
+}
+
+/*! \brief Append the pages written since the last snapshot to the save file, every SAVE_PERIOD_MS. Must be called from core 0 */
+void save_step() {
+    if (!save_state.active || millis() - save_state.last_ms < SAVE_PERIOD_MS) {
+        return;
+    }
+    save_state.last_ms = millis();
+    uint32_t start_us = time_us_32();
+
+    static uint16_t pages[DIRTY_PAGES];
+    uint16_t count = 0;
+    for (uint16_t page = 0; page < DIRTY_PAGES; page++) {
+        if (dirty_pages[page] && save_state.saved[page]) {
+            pages[count++] = page;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+
+    if (save_state.file.size() > SAVE_COMPACT_FACTOR * save_full_size()) {
+        save_state.file.close();
+        save_state.file = create_file(save_state.path);
+        count = 0;
+        for (uint16_t page = 0; page < DIRTY_PAGES; page++) {
+            if (save_state.saved[page]) {
+                pages[count++] = page;
+            }
+        }
+    }
+
+    SaveBlockHeader header = {SAVE_MAGIC, count, current_bank, 0, save_state.sequence++};
+    bool failed = save_state.file.write((uint8_t*) &header, sizeof(header)) != sizeof(header);
+    for (uint16_t i = 0; i < count && !failed; i++) {
+        dirty_pages[pages[i]] = 0;
+        __dmb();
+        failed |= save_state.file.write((uint8_t*) &pages[i], sizeof(pages[i])) != sizeof(pages[i]);
+        failed |= save_state.file.write(save_page_data(pages[i]), SAVE_PAGE_SIZE) != SAVE_PAGE_SIZE;
+    }
+    save_state.file.flush();
+    save_state.active = !failed;
+
+    uint32_t elapsed = time_us_32() - start_us;
+    save_stats.snapshots++;
+    save_stats.last_pages = count;
+    save_stats.last_bytes = sizeof(header) + count * (sizeof(uint16_t) + SAVE_PAGE_SIZE);
+    save_stats.last_us = elapsed;
+    save_stats.max_us = max(save_stats.max_us, elapsed);
+}
+
+/*! \brief Print how big and how long snapshots are, next to a snapshot of the whole 64K
+ *
+ * \param out Where to print the report (e.g. Serial)
+ */
+void print_save_stats(Print &out) {
+    const SaveStats &stats = save_stats;
+    uint32_t full_bytes = sizeof(SaveBlockHeader) + 0x100 * (sizeof(uint16_t) + SAVE_PAGE_SIZE);
+    uint32_t full_us = stats.last_bytes ? (uint64_t) stats.last_us * full_bytes / stats.last_bytes : 0;
+    out.printf("Save states: %s, slot %u, %lu snapshots, last %u pages (%lu bytes) in %lu us, max %lu us\n",
+               save_state.active ? "on" : "off", (uint8_t) save_slot, stats.snapshots, stats.last_pages, stats.last_bytes, stats.last_us,
+               stats.max_us);
+    out.printf("Save states: all 64K would be %lu bytes, ~%lu us at the same rate, restored %u pages in %lu us\n",
+               full_bytes, full_us, stats.restored_pages, stats.restore_us);
+}
@@ -0,0 +1,243 @@
+/** \file sd_benchmark.hpp
+ *
+ * \brief Times the directory index and ROM loading over a whole library, at each SD clock
+ *
+ * \details With SD_BENCHMARK set in config.hpp, core 0 mounts the SD card at
+ * each of SD_SPEEDS_HZ in turn, and for each clock:
+ *
+ * 1. Rebuilds the index with directory_build(), and opens it.
+ * 2. Runs a whole signature check, as directory_verify_step() does after boot.
+ * 3. Looks up every letter with directory_find_letter().
+ * 4. Opens and loads up to SD_BENCHMARK_LOADS files, spread evenly over the
+ *    index, with directory_open_file() and load_game().
+ * 5. Writes SD_BENCHMARK_FILE_SIZE bytes to a scratch file, then reads it back
+ *    with each of SD_BENCHMARK_READ_SIZES, to give the raw throughput of the
+ *    SPI transport at that clock apart from the loader's parsing.
+ *
+ * The report is printed over USB serial. Loads are totalled for each
+ * LOAD_FORMAT from load_stats, so the time spent blinking an error code for an
+ * invalid file isn't counted.
+ *
+ * Tools/make_library.py generates libraries to run it over, of any size and
+ * mix of BIN and CHF files, packed or not. It can also add damaged files, with
+ * SD_BENCHMARK_DAMAGED in their name, that load_game() must reject. One that's
+ * accepted is counted, and fails the benchmark.
+ *
+ * Games are loaded over the menu, so the Pico must not be plugged into a
+ * console while the benchmark runs.
+ */
+
+#pragma once
+
+#include "config.hpp"
+#include "file_cache.hpp"
+#include "loader.hpp"
+#include "sd_card.hpp"
+
+#include <SD.h>
+
+inline constexpr uint16_t SD_BENCHMARK_LOADS = 256;             // Files loaded at each clock
+inline constexpr const char* SD_BENCHMARK_DAMAGED = "damaged";  // In the name of files that must not load
+inline constexpr char SD_BENCHMARK_PATH[] = "/.pvcbench";       // Scratch file, left out of the index by its name
+inline constexpr uint32_t SD_BENCHMARK_FILE_SIZE = 0x40000;     // Size of the scratch file
+inline constexpr uint32_t SD_BENCHMARK_WRITE_SIZE = 0x4000;     // Bytes per write()
+inline constexpr uint32_t SD_BENCHMARK_READ_SIZES[] = {512, LOAD_BLOCK_SIZE, 0x4000};  // Bytes per read()
+inline constexpr uint8_t SD_BENCHMARK_READ_COUNT = sizeof(SD_BENCHMARK_READ_SIZES) / sizeof(SD_BENCHMARK_READ_SIZES[0]);
+
+static_assert(SD_BENCHMARK_WRITE_SIZE <= VIDEOCART_SIZE && SD_BENCHMARK_READ_SIZES[SD_BENCHMARK_READ_COUNT - 1] <= VIDEOCART_SIZE,
+              "Transfers use program_rom as their buffer");
+
+struct SdBenchmarkPass {
+    uint32_t hz;                // 0 if the card didn't work at this clock
+    uint32_t build_ms;          // directory_build()
+    uint32_t open_ms;           // Opening the index and filling the first window
+    uint32_t verify_ms;         // A whole signature check
+    uint32_t find_us_max;       // Slowest directory_find_letter()
+    uint32_t open_file_us;      // Total time in directory_open_file()
+    uint32_t open_file_us_max;
+    uint16_t files;             // Files opened
+    uint16_t invalid;           // Files load_game() rejected
+    uint16_t damaged_accepted;  // Damaged files load_game() didn't reject
+    LoadStats formats[LOAD_FORMAT::COUNT];  // Totals over the pass
+    uint32_t write_us;          // Writing the scratch file, 0 if it couldn't be written
+    uint32_t read_us[SD_BENCHMARK_READ_COUNT];  // Reading it back with each read size
+};
+
+inline SdBenchmarkPass sd_benchmark_passes[sizeof(SD_SPEEDS_HZ) / sizeof(SD_SPEEDS_HZ[0])] = {};
+inline uint16_t sd_benchmark_entries = 0;
+
+/*! \brief Open a file from the index and load it, adding the times to a pass
+ *
+ * \param pass The pass
+ * \param index Position of the entry in the index
+ */
+void sd_benchmark_load(SdBenchmarkPass &pass, uint16_t index) {
+    file_info entry;
+    if (!directory_read(index, entry) || !entry.isFile) {
+        return;
+    }
+    uint32_t start_us = time_us_32();
+    File file = directory_open_file(index);
+    uint32_t elapsed = time_us_32() - start_us;
+    if (!file) {
+        return;
+    }
+    pass.files++;
+    pass.open_file_us += elapsed;
+    pass.open_file_us_max = max(pass.open_file_us_max, elapsed);
+    bool damaged = strstr(file.name(), SD_BENCHMARK_DAMAGED) != nullptr;
+
+    uint32_t loads[LOAD_FORMAT::COUNT];
+    for (uint8_t format = 0; format < LOAD_FORMAT::COUNT; format++) {
+        loads[format] = load_stats[format].loads;
+    }
+    bool valid = load_game(file);
+    pass.invalid += !valid;
+    pass.damaged_accepted += damaged && valid;
+    for (uint8_t format = 0; format < LOAD_FORMAT::COUNT; format++) {
+        if (load_stats[format].loads != loads[format]) {
+            const LoadStats &last = load_stats[format];
+            LoadStats &total = pass.formats[format];
+            total.bytes += last.bytes;
+            total.loaded += last.loaded;
+            total.us += last.us;
+            total.reads += last.reads;
+            total.loads++;
+        }
+    }
+}
+
+/*! \brief Write the scratch file, then read it back with each read size
+ *
+ * \details The data is whatever is in program_rom, as the loads have already
+ * replaced the menu.
+ *
+ * \param pass Where to store the times
+ */
+void sd_benchmark_transfer(SdBenchmarkPass &pass) {
+    uint8_t* buffer = program_rom + VIDEOCART_START_ADDR;
+    uint32_t start_us = time_us_32();
+    File file = create_file(SD_BENCHMARK_PATH);
+    uint32_t written = 0;
+    while (file && written < SD_BENCHMARK_FILE_SIZE && file.write(buffer, SD_BENCHMARK_WRITE_SIZE) == SD_BENCHMARK_WRITE_SIZE) {
+        written += SD_BENCHMARK_WRITE_SIZE;
+    }
+    file.close();
+    if (written < SD_BENCHMARK_FILE_SIZE) {
+        return;
+    }
+    pass.write_us = time_us_32() - start_us;
+
+    for (uint8_t i = 0; i < SD_BENCHMARK_READ_COUNT; i++) {
+        start_us = time_us_32();
+        file = SD.open(SD_BENCHMARK_PATH, FILE_READ);
+        while (file && file.read(buffer, SD_BENCHMARK_READ_SIZES[i]) == SD_BENCHMARK_READ_SIZES[i]) {
+            tight_loop_contents();
+        }
+        file.close();
+        pass.read_us[i] = time_us_32() - start_us;
+    }
+    SD.remove(SD_BENCHMARK_PATH);
+}
+
+/*! \brief Run every step at one clock
+ *
+ * \param pass Where to store the times
+ * \param hz The SPI clock
+ */
+void sd_benchmark_pass(SdBenchmarkPass &pass, uint32_t hz) {
+    directory_index.close();
+    SD.end();
+    if (!sd_try(hz)) {
+        return;
+    }
+    pass.hz = hz;
+
+    if (!directory_build()) {
+        return;
+    }
+    pass.build_ms = directory_stats.build_ms;
+    uint32_t start_ms = millis();
+    uint32_t signature;
+    if (!directory_open_index(signature)) {
+        directory_size = 0;
+        return;
+    }
+    directory_fill_window(0);
+    pass.open_ms = millis() - start_ms;
+    sd_benchmark_entries = directory_size;
+
+    directory_verify_begin(signature);
+    while (directory_verify_step()) {
+        tight_loop_contents();
+    }
+    pass.verify_ms = directory_stats.verify_ms;
+
+    for (char letter = 'A'; letter <= 'Z'; letter++) {
+        uint32_t start_us = time_us_32();
+        directory_find_letter(letter);
+        pass.find_us_max = max(pass.find_us_max, time_us_32() - start_us);
+    }
+
+    uint16_t size = directory_size;
+    uint16_t count = min(size, SD_BENCHMARK_LOADS);
+    for (uint16_t i = 0; i < count; i++) {
+        sd_benchmark_load(pass, (uint32_t) i * size / count);
+    }
+    sd_benchmark_transfer(pass);
+}
+
+/*! \brief Run the benchmark at every clock, then mount the card again as at boot. Must be called from core 0 */
+void run_sd_benchmark() {
+    if (directory_scan.active) {
+        directory_scan.dir.close();
+        directory_scan.active = false;
+    }
+    for (uint8_t i = 0; i < sizeof(SD_SPEEDS_HZ) / sizeof(SD_SPEEDS_HZ[0]); i++) {
+        sd_benchmark_pass(sd_benchmark_passes[i], SD_SPEEDS_HZ[i]);
+    }
+    directory_index.close();
+    SD.end();
+    sd_begin();
+    directory_open();
+}
+
+/*! \brief Print the result of the benchmark
+ *
+ * \param out Where to print the report (e.g. Serial)
+ */
+void print_sd_benchmark(Print &out) {
+    out.printf("SD benchmark: %u entries, up to %u files loaded at each clock\n", sd_benchmark_entries, SD_BENCHMARK_LOADS);
+    uint32_t damaged_accepted = 0;
+    for (const SdBenchmarkPass &pass : sd_benchmark_passes) {
+        if (pass.hz == 0) {
+            out.printf("SD card didn't work at one of the clocks\n");
+            continue;
+        }
+        out.printf("%lu MHz: index built in %lu ms, opened in %lu ms, checked in %lu ms, letter lookup max %lu us\n",
+                   pass.hz / 1000000, pass.build_ms, pass.open_ms, pass.verify_ms, pass.find_us_max);
+        out.printf("%lu MHz: %u files opened in mean %lu us (max %lu us), %u invalid, %u damaged files accepted\n",
+                   pass.hz / 1000000, pass.files, pass.files ? pass.open_file_us / pass.files : 0, pass.open_file_us_max,
+                   pass.invalid, pass.damaged_accepted);
+        for (uint8_t format = 0; format < LOAD_FORMAT::COUNT; format++) {
+            const LoadStats &stats = pass.formats[format];
+            if (stats.loads != 0) {
+                out.printf("%lu MHz: %s: %lu loads, mean %lu us and %lu SD reads, %lu KB/s loaded\n", pass.hz / 1000000,
+                           LOAD_FORMAT_NAMES[format], stats.loads, stats.us / stats.loads, stats.reads / stats.loads,
+                           stats.us ? (uint32_t) (stats.loaded * 1000ull / stats.us) : 0);
+            }
+        }
+        if (pass.write_us != 0) {
+            out.printf("%lu MHz: %lu KB written at %lu KB/s, read at", pass.hz / 1000000, SD_BENCHMARK_FILE_SIZE / 1024,
+                       (uint32_t) (SD_BENCHMARK_FILE_SIZE * 1000ull / pass.write_us));
+            for (uint8_t i = 0; i < SD_BENCHMARK_READ_COUNT; i++) {
+                uint32_t us = pass.read_us[i];
+                out.printf(" %lu KB/s (%lu byte reads)", us ? (uint32_t) (SD_BENCHMARK_FILE_SIZE * 1000ull / us) : 0,
+                           SD_BENCHMARK_READ_SIZES[i]);
+            }
+            out.printf("\n");
+        }
+        damaged_accepted += pass.damaged_accepted;
+    }
+    out.printf(damaged_accepted == 0 ? "PASS\n" : "FAIL\n");
+}
@@ -0,0 +1,97 @@
+/** \file sd_card.hpp
+ *
+ * \brief Brings up the SD card at the fastest SPI clock it works at
+ *
+ * \details sd_begin() first tries the clock the card last worked at (kept in
+ * flash, see flash_settings()), then each of SD_SPEEDS_HZ from the fastest
+ * down. A clock is only accepted if the card mounts and reads back the start of
+ * boot.bin twice with the same result, as a clock that's too fast for the card
+ * or the wiring gives reads that change from one to the next.
+ *
+ * If no clock works, there is no card, and every clock is tried again after
+ * 250 ms.
+ *
+ * The card runs in SPI mode, the only one rev 2A can use: only its CLK, CMD,
+ * DAT0 and DAT3 lines are wired (SERIAL_CLOCK_PIN, TRANSMIT_PIN, RECEIVE_PIN
+ * and SD_CARD_CHIP_SELECT_PIN), and the FRAM shares them. The 4-bit SD bus
+ * needs DAT1 and DAT2 as well. SD_BENCHMARK (see sd_benchmark.hpp) measures
+ * what SPI gives at each clock.
+ */
+
+#pragma once
+
+#include "flash_cache.hpp"
+#include "gpio.hpp"
+
+#include <SD.h>
+
+inline constexpr uint32_t SD_SPEEDS_HZ[] = {SD_SCK_MHZ(50), SD_SCK_MHZ(25), SD_SCK_MHZ(4)};  // Fastest first
+inline constexpr uint32_t SD_VERIFY_SIZE = 2048;  // Bytes of boot.bin read back to check a clock
+
+struct SdStats {
+    uint32_t speed_hz;  // Clock the card is running at
+    uint32_t attempts;  // Calls to SD.begin()
+    uint32_t rejected;  // Clocks the card mounted at but failed the read back
+};
+
+inline SdStats sd_stats = {};
+
+/*! \brief Read the start of boot.bin twice and compare
+ *
+ * \return false if the two reads differ. If there's no boot.bin, there's
+ * nothing to compare and the mount is trusted.
+ */
+bool sd_verify() {
+    static uint8_t first[SD_VERIFY_SIZE];
+    static uint8_t second[SD_VERIFY_SIZE];
+    File file = SD.open("/boot.bin", FILE_READ);
+    if (!file) {
+        return true;
+    }
+    size_t length = file.read(first, SD_VERIFY_SIZE);
+    file.seek(0, SeekSet);
+    bool same = file.read(second, SD_VERIFY_SIZE) == length && memcmp(first, second, length) == 0;
+    file.close();
+    return same;
+}
+
+/*! \brief Mount the SD card at a clock, and check it works
+ *
+ * \param hz The SPI clock
+ * \return true if the card is ready to use
+ */
+bool sd_try(uint32_t hz) {
+    sd_stats.attempts++;
+    if (SD.begin(SD_CARD_CHIP_SELECT_PIN, hz)) {
+        if (sd_verify()) {
+            sd_stats.speed_hz = hz;
+            return true;
+        }
+        sd_stats.rejected++;
+    }
+    SD.end();
+    return false;
+}
+
+/*! \brief Wait for an SD card and mount it at the fastest working clock. Must be called from core 0 */
+void sd_begin() {
+    uint32_t remembered = flash_settings().sd_speed_hz;
+    for (;;) {
+        if (remembered != 0 && sd_try(remembered)) {
+            return;
+        }
+        for (uint32_t hz : SD_SPEEDS_HZ) {
+            if (hz != remembered && sd_try(hz)) {
+                return;
+            }
+        }
+        sleep_ms(250); // Wait for SD card
+    }
+}
+
+/*! \brief Store the working clock for the next power on, if it changed. Must be called from core 0 while the menu is running */
+void sd_remember_speed() {
+    FlashSettings settings = flash_settings();
+    settings.sd_speed_hz = sd_stats.speed_hz;
+    flash_settings_save(settings);
+}
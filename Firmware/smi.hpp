@@ -0,0 +1,160 @@
+/** \file smi.hpp
+ *
+ * \brief Interrupts and the programmable timer of the 3853 SMI
+ *
+ * \details The 3853 has four I/O ports besides its memory interface:
+ *
+ *  Port | Register          | Access
+ *  -----|-------------------|-------
+ *  C    | Vector high byte  | Read/write
+ *  D    | Vector low byte   | Read/write
+ *  E    | Interrupt control | Write only (the bus isn't driven)
+ *  F    | Timer             | Write only (the bus isn't driven)
+ *
+ * The timer is an 8-bit shift register, clocked every 31 PHI periods, that
+ * steps through 255 states in a fixed pseudo-random order. Writing a state to
+ * port F starts it there, and it interrupts at the end of the sequence, then
+ * starts again from 0xFE. Writing 0xFF stops it.
+ *
+ * Interrupt control bits 0 - 1:
+ *
+ *  Value | Interrupts
+ *  ------|-----------
+ *  00    | None
+ *  01    | External (EXTERNAL_INT_PIN)
+ *  10    | None
+ *  11    | Timer
+ *
+ * Rather than having core 1 count PHI, the timer is a PhiTimer (see
+ * phi_timer.hpp), and its interrupts and external ones are requested on core 0
+ * (see interrupts.hpp). Core 1 only gets involved when the CPU acknowledges,
+ * and the SMI puts its vector on the bus. Bit 7 of the low byte is 0 for the
+ * timer and 1 for an external interrupt.
+ *
+ * Refer to the 3853 SMI datasheet for more information.
+ */
+
+#pragma once
+
+#include "interrupts.hpp"
+#include "phi_timer.hpp"
+#include "ports.hpp"
+
+inline constexpr uint8_t SMI_VECTOR_HIGH_PORT = 0x0C;
+inline constexpr uint8_t SMI_VECTOR_LOW_PORT = 0x0D;
+inline constexpr uint8_t SMI_CONTROL_PORT = 0x0E;
+inline constexpr uint8_t SMI_TIMER_PORT = 0x0F;
+inline constexpr uint32_t SMI_PRESCALE = 31;    // PHI periods per timer state
+inline constexpr uint8_t SMI_TIMER_STOP = 0xFF;
+inline constexpr uint8_t SMI_TIMER_RELOAD = 0xFE;  // State the timer starts again from after interrupting
+
+namespace SMI_CONTROL {
+    inline constexpr uint8_t MASK = 0x3;
+    inline constexpr uint8_t EXTERNAL = 0x1;
+    inline constexpr uint8_t TIMER = 0x3;
+}
+
+/*! \brief Number of timer steps from each state to the interrupt
+ *
+ * \details Walks the shift register forwards from SMI_TIMER_RELOAD, the
+ * longest count. Its feedback is the inverted XOR of bits 7, 5, 4 and 3.
+ */
+struct SmiTimerSteps {
+    uint8_t steps[256];
+
+    constexpr SmiTimerSteps(): steps() {
+        uint8_t state = SMI_TIMER_RELOAD;
+        for (int16_t i = SMI_TIMER_RELOAD; i >= 0; i--) {
+            steps[state] = i;
+            uint8_t feedback = ((state >> 7) ^ (state >> 5) ^ (state >> 4) ^ (state >> 3) ^ 1) & 1;
+            state = state << 1 | feedback;
+        }
+    }
+};
+
+inline constexpr SmiTimerSteps SMI_TIMER_STEPS;
+
+/*! \brief Check the timer passes through every state but SMI_TIMER_STOP once */
+constexpr bool smi_timer_steps_valid() {
+    bool seen[SMI_TIMER_STOP] = {};
+    for (uint8_t state = 0; state < SMI_TIMER_STOP; state++) {
+        uint8_t steps = SMI_TIMER_STEPS.steps[state];
+        if (steps >= SMI_TIMER_STOP || seen[steps]) {
+            return false;
+        }
+        seen[steps] = true;
+    }
+    return true;
+}
+
+static_assert(smi_timer_steps_valid(), "The timer must count through 255 states");
+static_assert(SMI_TIMER_STEPS.steps[SMI_TIMER_RELOAD] == 254, "The timer takes 255 states to return to 0xFE");
+
+inline PhiTimer smi_timer;
+inline uint8_t smi_vector_high = 0;
+inline uint8_t smi_vector_low = 0;
+
+/*! \brief Start the timer from a state, or stop it */
+void smi_timer_start(uint8_t state) {
+    if (state == SMI_TIMER_STOP) {
+        smi_timer.stop();
+        return;
+    }
+    uint32_t first = SMI_TIMER_STEPS.steps[state] * SMI_PRESCALE;
+    smi_timer.start(first ? first : 1, SMI_TIMER_STEPS.steps[SMI_TIMER_RELOAD] * SMI_PRESCALE);
+}
+
+/*! \brief Give both interrupt sources the current vector */
+void smi_set_vectors() {
+    uint16_t vector = smi_vector_high << 8 | smi_vector_low;
+    interrupt_sources[INTERRUPT::SMI_TIMER].vector = vector & ~0x80;
+    interrupt_sources[INTERRUPT::SMI_EXTERNAL].vector = vector | 0x80;
+}
+
+/*! \brief Claim the timer. Must be called from core 0, after interrupts_init() */
+void smi_init() {
+    smi_timer.init([]() {interrupt_request(INTERRUPT::SMI_TIMER);});
+    interrupt_sources[INTERRUPT::SMI_EXTERNAL].external_edges = GPIO_IRQ_EDGE_FALL;
+}
+
+/*! \brief Stop the timer, for the next game */
+void smi_reset() {
+    smi_timer.stop();
+    smi_vector_high = smi_vector_low = 0;
+    smi_set_vectors();
+}
+
+/*! \brief One of the four ports of the 3853 SMI */
+class SmiPort {
+    public:
+        static uint8_t read(uint8_t port) {
+            switch (port) {
+                case SMI_VECTOR_HIGH_PORT:
+                    return smi_vector_high;
+                case SMI_VECTOR_LOW_PORT:
+                    return smi_vector_low;
+                default:
+                    return 0; // Not reached, E and F are attached write only
+            }
+        }
+
+        static void write(uint8_t port, uint8_t data) {
+            switch (port) {
+                case SMI_VECTOR_HIGH_PORT:
+                    smi_vector_high = data;
+                    smi_set_vectors();
+                    break;
+                case SMI_VECTOR_LOW_PORT:
+                    smi_vector_low = data;
+                    smi_set_vectors();
+                    break;
+                case SMI_CONTROL_PORT:
+                    interrupt_enable(INTERRUPT::SMI_TIMER, (data & SMI_CONTROL::MASK) == SMI_CONTROL::TIMER);
+                    interrupt_enable(INTERRUPT::SMI_EXTERNAL, (data & SMI_CONTROL::MASK) == SMI_CONTROL::EXTERNAL);
+                    break;
+                case SMI_TIMER_PORT:
+                    smi_timer_start(data);
+                    break;
+            }
+        }
+};
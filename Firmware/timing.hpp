@@ -0,0 +1,78 @@
+/** \file timing.hpp
+ *
+ * \brief Cycle counting with the SysTick timer
+ *
+ * \details The Cortex-M0+ has no DWT cycle counter, but each core has its own
+ * 24-bit SysTick timer that can be clocked from the processor clock. This gives
+ * single cycle resolution for intervals of up to 2^24 cycles (~40 ms at 400 MHz),
+ * which is plenty for measuring a bus cycle.
+ *
+ * Longer intervals, such as the phases of startup, are timed in microseconds
+ * since power on with the system timer, which isn't affected by the overclock.
+ */
+
+#pragma once
+
+#include <hardware/clocks.h>
+#include <hardware/structs/systick.h>
+#include <hardware/timer.h>
+
+inline constexpr uint32_t SYSTICK_MASK = 0xFFFFFF;
+
+/*! \brief Start the SysTick timer of the calling core, clocked from the processor clock */
+inline void cycle_counter_init() {
+    systick_hw->csr = 0;
+    systick_hw->rvr = SYSTICK_MASK;
+    systick_hw->cvr = 0;
+    systick_hw->csr = M0PLUS_SYST_CSR_CLKSOURCE_BITS | M0PLUS_SYST_CSR_ENABLE_BITS;
+}
+
+/*! \brief Get the current SysTick value
+ *
+ * \return 24-bit counter value (counts down)
+ */
+__force_inline uint32_t cycle_count() {
+    return systick_hw->cvr;
+}
+
+/*! \brief Get the cycles elapsed between two counter values
+ *
+ * \param start The earlier counter value
+ * \param end The later counter value
+ * \return Elapsed processor cycles
+ */
+__force_inline uint32_t cycles_elapsed(uint32_t start, uint32_t end) {
+    return (start - end) & SYSTICK_MASK;
+}
+
+/*! \brief Convert processor cycles to nanoseconds at the current system clock */
+inline uint32_t cycles_to_ns(uint64_t cycles) {
+    return cycles * 1000000000ull / clock_get_hz(clk_sys);
+}
+
+// Startup phases
+
+namespace STARTUP {
+    inline constexpr uint8_t CLOCK = 0;      // setup1(): core voltage and system clock
+    inline constexpr uint8_t SD_INIT = 1;    // Bringing up the SD card (see sd_card.hpp)
+    inline constexpr uint8_t ROM_LOAD = 2;   // Loading the menu, from flash or the SD card
+    inline constexpr uint8_t DIRECTORY = 3;  // Opening the directory index
+    inline constexpr uint8_t COUNT = 4;
+}
+
+inline constexpr const char* STARTUP_PHASE_NAMES[STARTUP::COUNT] = {"Clock setup", "SD init", "ROM load", "Directory"};
+
+struct StartupPhase {
+    uint32_t start_us;  // Time since power on
+    uint32_t end_us;
+};
+
+inline StartupPhase startup_phases[STARTUP::COUNT] = {};  // Phases that didn't run are left at 0
+
+__force_inline void startup_begin(uint8_t phase) {
+    startup_phases[phase].start_us = time_us_32();
+}
+
+__force_inline void startup_end(uint8_t phase) {
+    startup_phases[phase].end_us = time_us_32();
+}
@@ -0,0 +1,168 @@
+/** \file trace.hpp
+ *
+ * \brief Records bus cycles, for finding out what a misbehaving game did
+ *
+ * \details With BUS_TRACE set in config.hpp, core 1 takes a trace_snapshot()
+ * of (romc, dbus, pc0, dc0) at every rising edge of WRITE, before
+ * execute_romc(), and hands it to trace_cycle() once the data bus has been
+ * driven, so the edge-to-drive window only pays for a few register copies.
+ * Once trace_trigger fires, that cycle and the ones after it are pushed to
+ * bus_trace, a lock-free ring (see ring.hpp). The cost per cycle is fixed: a
+ * few compares, and at most one push. When the ring is full the record is
+ * dropped and counted, so core 1 never waits.
+ *
+ * Core 0 drains the ring with trace_drain(), to TRACE_PATH on the SD card, or
+ * over USB serial with TRACE_TO_SERIAL. Both get the same stream of blocks:
+ *
+ * | Field           | Size | Meaning
+ * |-----------------|------|--------
+ * | magic           | 4    | "PVTR"
+ * | count           | 2    | Records in the block
+ * | record_size     | 2    | sizeof(TraceRecord)
+ * | dropped         | 4    | Records dropped since tracing started
+ * | records         | 8n   | TraceRecord, little endian
+ *
+ * so a capture can be picked up at any block. The file is replaced by the first
+ * block after each power on. The records hold the registers
+ * as they were at the rising edge, before the cycle was executed. Decode them
+ * with Tools/trace_decode.py, or replay them through another build (see
+ * replay.hpp).
+ *
+ * A full bus runs at ~450K cycles/s, which is more than either the SD card or
+ * USB serial keeps up with, so trace every cycle only in short bursts. The
+ * cost of tracing is timed by the ROMC benchmark (see benchmark.hpp).
+ */
+
+#pragma once
+
+#include "config.hpp"
+#include "ring.hpp"
+#include "romc.hpp"
+
+#include <SD.h>
+
+inline constexpr uint32_t TRACE_RING_SIZE = 2048;  // Records, 16K of RAM
+inline constexpr uint32_t TRACE_BLOCK_RECORDS = 64;
+inline constexpr uint32_t TRACE_MAGIC = 0x52545650;  // "PVTR"
+inline constexpr const char* TRACE_PATH = "/.pvctrace";  // Kept out of the menu (see INDEX_FILE_PREFIX)
+
+struct __attribute__((packed)) TraceRecord {
+    uint16_t cycle;  // Low bits of the cycle count, so gaps between records show
+    uint8_t romc;
+    uint8_t dbus;
+    uint16_t pc0;
+    uint16_t dc0;
+};
+
+struct __attribute__((packed)) TraceBlockHeader {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t record_size;
+    uint32_t dropped;
+};
+
+/*! \brief When to start recording
+ *
+ * \details The trigger fires on a cycle that matches any of its conditions, and
+ * the next `length` cycles are recorded, starting with that one. Then it waits
+ * to fire again. The default records every cycle.
+ */
+struct TraceTrigger {
+    uint32_t romc_mask;     // ROMC codes that fire, bit n for code n
+    uint16_t address;       // PC0 or DC0 within [address, address + address_count) fires
+    int16_t port;           // A read or write of this I/O port fires, -1 to disable
+    uint32_t address_count; // 0 to disable
+    uint32_t length;        // Cycles recorded when it fires, 0 for all of them
+};
+
+inline TraceTrigger trace_trigger = {0xFFFFFFFF, 0, -1, 0, 0};
+inline SpscRing<TraceRecord, TRACE_RING_SIZE> bus_trace;
+inline uint32_t trace_cycles = 0;     // Cycles seen, updated by core 1
+inline uint32_t trace_remaining = 0;  // Cycles left to record since the trigger fired
+inline bool trace_recording = false;
+
+struct TraceStats {
+    uint32_t records;  // Records written out
+    uint32_t blocks;
+    uint32_t write_us_max;  // Longest time to write a block
+};
+
+inline TraceStats trace_stats = {};
+
+/*! \brief Check the trigger against a cycle
+ *
+ * \details io_address isn't changed by ROMC 0x1A/0x1B, so it's still the
+ * port of the cycle after execute_romc().
+ */
+__force_inline bool trace_triggered(const TraceRecord &record) {
+    const TraceTrigger &t = trace_trigger;
+    bool io = record.romc == 0x1A || record.romc == 0x1B;
+    return ((t.romc_mask >> record.romc) & 1)
+        || (uint16_t) (record.pc0 - t.address) < t.address_count
+        || (uint16_t) (record.dc0 - t.address) < t.address_count
+        || (io && t.port == io_address);
+}
+
+/*! \brief Take the state of the current cycle, before it's executed. Must be called from core 1 */
+__force_inline TraceRecord trace_snapshot() {
+    return {(uint16_t) trace_cycles++, romc, dbus, pc0, dc0};
+}
+
+/*! \brief Record a cycle if the trigger has fired. Must be called from core 1, after the data bus is driven
+ *
+ * \param record The cycle, from trace_snapshot()
+ */
+__force_inline void trace_cycle(const TraceRecord &record) {
+    if (!trace_recording) {
+        if (!trace_triggered(record)) {
+            return;
+        }
+        trace_recording = true;
+        trace_remaining = trace_trigger.length;
+    }
+    bus_trace.push(record);
+    if (trace_remaining != 0 && --trace_remaining == 0) {
+        trace_recording = false;
+    }
+}
+
+/*! \brief Write up to a block of recorded cycles out. Must be called from core 0
+ *
+ * \details The ring fills in a few milliseconds of tracing every cycle, so
+ * this should be called again as soon as possible.
+ */
+void trace_drain() {
+    static File trace_file;
+    static struct __attribute__((packed)) {
+        TraceBlockHeader header;
+        TraceRecord records[TRACE_BLOCK_RECORDS];
+    } block;
+
+    uint16_t count = 0;
+    while (count < TRACE_BLOCK_RECORDS && bus_trace.pop(block.records[count])) {
+        count++;
+    }
+    if (count == 0) {
+        return;
+    }
+    block.header = {TRACE_MAGIC, count, sizeof(TraceRecord), bus_trace.dropped};
+    size_t size = sizeof(TraceBlockHeader) + count * sizeof(TraceRecord);
+
+    uint32_t start_us = time_us_32();
+    if constexpr (TRACE_TO_SERIAL) {
+        Serial.write((const uint8_t*) &block, size);
+    } else {
+        if (!trace_file) {
+            SD.remove(TRACE_PATH);
+            trace_file = SD.open(TRACE_PATH, FILE_WRITE);
+        }
+        trace_file.write((const uint8_t*) &block, size);
+        if (trace_stats.blocks % 16 == 15) {
+            trace_file.flush();  // Keep the file readable if the power is cut
+        }
+    }
+    uint32_t write_us = time_us_32() - start_us;
+    trace_stats.write_us_max = write_us > trace_stats.write_us_max ? write_us : trace_stats.write_us_max;
+    trace_stats.records += count;
+    trace_stats.blocks++;
+}
@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+"""Generate a library of ROM files to benchmark the directory index and loader on (see Firmware/sd_benchmark.hpp).
+
+Writes --files games with random titles into a new directory, to be copied to
+the root of an SD card next to boot.bin. --chf sets the share of CHF files
+(the rest are BIN), and --packed the share packed with pack_rom.py. Games are
+2K to 32K of ROM, and about half of each is repeated code, so packing works on
+them much as it does on real games. Some CHF files are given a second chip
+packet of RAM.
+
+--damaged adds files the loader must reject, named with "damaged" so the
+benchmark can tell them apart: headers longer than the file, chip packets that
+run past the end of the file or the address space, and LZ4 blocks that are cut
+short. Each is checked against the rules of the loader before it's written.
+
+    python3 make_library.py /media/sd/bench --files 100 --chf 0.5 --packed 0.25
+    python3 make_library.py bench-10k --files 10000 --damaged 20 --seed 7
+"""
+
+import argparse
+import os
+import random
+import struct
+import sys
+
+import pack_rom
+
+CART_HEADER = 0x55            # First byte of every Channel F cartridge
+ROM_START = 0x0800
+ROM_SIZES = (0x0800, 0x1000, 0x1800, 0x2000, 0x4000, 0x8000)
+ROM_CHIP, RAM_CHIP = 0, 1
+CHF_VERSION = (0, 1)          # minor, major
+WORDS = ("Alien", "Bowling", "Casino", "Dodge", "Escape", "Fairchild", "Galaxy", "Hangman", "Invaders", "Jet",
+         "Karate", "Labyrinth", "Maze", "Ninja", "Orbit", "Pinball", "Quest", "Racer", "Space", "Tennis", "Ufo",
+         "Video", "Whizball", "Xenon", "Yacht", "Zap")
+
+
+def rom_data(generator, size):
+    """Random code, about half of it copies of earlier runs."""
+    data = bytearray([CART_HEADER, 0x2B])
+    while len(data) < size:
+        if len(data) > 64 and generator.random() < 0.5:
+            start = generator.randrange(len(data) - 32)
+            data += data[start:start + generator.randrange(8, 32)]
+        else:
+            data += bytes(generator.getrandbits(8) for _ in range(generator.randrange(4, 24)))
+    return bytes(data[:size])
+
+
+def chip_packet(chip_type, address, data, size=None):
+    size = len(data) if size is None else size
+    return pack_rom.CHIP_HEADER.pack(pack_rom.CHIP_MAGIC, pack_rom.CHIP_HEADER.size + len(data), chip_type, 0, address,
+                                     size) + data
+
+
+def chf_file(title, packets):
+    title = title.encode("ascii")
+    header_length = (pack_rom.CHF_HEADER.size + len(title) + 1 + 15) // 16 * 16
+    header = pack_rom.CHF_HEADER.pack(pack_rom.CHF_MAGIC, header_length, CHF_VERSION[0], CHF_VERSION[1], 0, 0, len(title))
+    return (header + title).ljust(header_length, b"\0") + b"".join(packets)
+
+
+def make_game(generator, title, chf, packed):
+    rom = rom_data(generator, generator.choice(ROM_SIZES))
+    if not chf:
+        return pack_rom.pack_bin(rom) if packed else rom
+    packets = [chip_packet(ROM_CHIP, ROM_START, rom)]
+    if generator.random() < 0.25:
+        packets.append(chip_packet(RAM_CHIP, 0x2800, b"", 0x800))
+    data = chf_file(title, packets)
+    return pack_rom.pack_chf(data) if packed else data
+
+
+def make_damaged(generator, number):
+    """A file the loader must reject, of one of several kinds."""
+    rom = rom_data(generator, 0x800)
+    kind = number % 5
+    if kind == 0:    # Header longer than the file
+        data = bytearray(chf_file("Damaged header", [chip_packet(ROM_CHIP, ROM_START, rom)]))
+        struct.pack_into("<I", data, 16, len(data) + 1)
+        return bytes(data)
+    if kind == 1:    # Packet runs past the end of the file
+        return chf_file("Damaged packet", [chip_packet(ROM_CHIP, ROM_START, rom)])[:-1]
+    if kind == 2:    # Packet runs past the end of the address space
+        return chf_file("Damaged address", [chip_packet(ROM_CHIP, 0xFC00, rom)])
+    if kind == 3:    # Packed BIN cut short
+        return pack_rom.pack_bin(rom)[:-3]
+    packed = bytearray(pack_rom.pack_chf(chf_file("Damaged block", [chip_packet(ROM_CHIP, ROM_START, bytes(0x800))])))
+    return bytes(packed[:-2])  # Packed packet cut short, its length no longer fits in the file
+
+
+def rejected(data):
+    """Check a damaged file breaks one of the rules the loader checks."""
+    if data.startswith(pack_rom.BIN_MAGIC):
+        size, = struct.unpack_from("<I", data, 4)
+        try:
+            pack_rom.decompress(data[8:], size)
+        except ValueError:
+            return True
+        return False
+    _, header_length, _, _, _, _, _ = pack_rom.CHF_HEADER.unpack_from(data, 0)
+    if header_length > len(data):
+        return True
+    position = header_length
+    while position + pack_rom.CHIP_HEADER.size <= len(data):
+        magic, packet_length, _, _, address, size = pack_rom.CHIP_HEADER.unpack_from(data, position)
+        if packet_length > len(data) - position or address + size > 0x10000:
+            return True
+        position += packet_length
+    return False
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("output", help="directory to create")
+    parser.add_argument("--files", type=int, default=100, help="games to generate (default 100)")
+    parser.add_argument("--chf", type=float, default=0.5, help="share of CHF files (default 0.5)")
+    parser.add_argument("--packed", type=float, default=0.0, help="share of packed files (default 0)")
+    parser.add_argument("--damaged", type=int, default=0, help="damaged files to add (default 0)")
+    parser.add_argument("--seed", type=int, default=3850, help="random seed, the same seed gives the same library")
+    args = parser.parse_args()
+
+    if args.files + args.damaged > 0xFFFF:
+        parser.error("the index holds at most 65535 entries")
+    try:
+        os.makedirs(args.output)
+    except FileExistsError:
+        parser.error("%s already exists" % args.output)
+
+    generator = random.Random(args.seed)
+    counts = {"BIN": 0, "CHF": 0, "packed": 0}
+    total = 0
+    for number in range(args.files):
+        chf = generator.random() < args.chf
+        packed = generator.random() < args.packed
+        title = "%s %s %d" % (generator.choice(WORDS), generator.choice(WORDS), number)
+        name = title + (".chf" if chf else ".bin")
+        data = make_game(generator, title, chf, packed)
+        with open(os.path.join(args.output, name), "wb") as file:
+            file.write(data)
+        counts["CHF" if chf else "BIN"] += 1
+        counts["packed"] += packed
+        total += len(data)
+    for number in range(args.damaged):
+        data = make_damaged(generator, number)
+        if not rejected(data):
+            sys.exit("damaged file %d would load" % number)
+        extension = ".bin" if data.startswith(pack_rom.BIN_MAGIC) else ".chf"
+        with open(os.path.join(args.output, "damaged %04d%s" % (number, extension)), "wb") as file:
+            file.write(data)
+        total += len(data)
+    print("%s: %d BIN, %d CHF (%d packed), %d damaged, %d bytes" % (args.output, counts["BIN"], counts["CHF"],
+                                                                     counts["packed"], args.damaged, total))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,215 @@
+#!/usr/bin/env python3
+"""Pack a .bin or .chf ROM with LZ4, for faster loading by the Videocart (see Firmware/loader.hpp).
+
+A packed .bin is "PVZ4", the size of the original file (4 bytes, little
+endian), then an LZ4 block of the whole file. In a packed .chf, the data of
+each chip packet of bank 0 is replaced by an LZ4 block and its magic number
+becomes "CHPZ", where that makes the packet smaller. The firmware decodes the
+blocks straight into memory as it reads them, so a packed ROM moves fewer bytes
+over SPI.
+
+Every packed file is decoded again and compared with the original before it's
+written. The packed file keeps the extension of the original, so the menu
+lists it the same way.
+
+    python3 pack_rom.py game.bin -o packed/game.bin
+    python3 pack_rom.py game.chf -o packed/game.chf
+    python3 pack_rom.py --self-test
+"""
+
+import argparse
+import os
+import random
+import struct
+import sys
+
+BIN_MAGIC = b"PVZ4"
+CHIP_MAGIC = b"CHIP"
+PACKED_CHIP_MAGIC = b"CHPZ"
+CHF_MAGIC = b"CHANNEL F       "
+CHF_HEADER = struct.Struct("<16sIBBHQB")  # magic, header_length, minor, major, hardware_type, reserved, title_length
+CHIP_HEADER = struct.Struct("<4sIHHHH")   # magic, packet_length, chip_type, bank_number, load_address, size
+DATA_CHIP_TYPES = {0, 2, 3}               # Chip types whose packets carry data (ROM, LED, NVRAM)
+BIN_LIMIT = 0xF7FF                        # Most of a .bin the firmware loads
+
+MIN_MATCH = 4
+LAST_LITERALS = 5  # The LZ4 block format ends with at least this many literals
+MATCH_LIMIT = 12   # and the last match starts at least this far from the end
+MAX_OFFSET = 0xFFFF
+
+
+def write_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def write_sequence(out, literals, offset=0, match=0):
+    match_code = match - MIN_MATCH if offset else 0
+    out.append(min(len(literals), 15) << 4 | min(match_code, 15))
+    if len(literals) >= 15:
+        write_length(out, len(literals) - 15)
+    out += literals
+    if offset:
+        out += struct.pack("<H", offset)
+        if match_code >= 15:
+            write_length(out, match_code - 15)
+
+
+def compress(data):
+    """Compress to an LZ4 block, greedily taking the last match of each 4 bytes."""
+    out = bytearray()
+    last_seen = {}
+    anchor = 0
+    position = 0
+    while position < len(data) - MATCH_LIMIT:
+        key = data[position:position + MIN_MATCH]
+        candidate = last_seen.get(key)
+        last_seen[key] = position
+        if candidate is None or position - candidate > MAX_OFFSET:
+            position += 1
+            continue
+        length = MIN_MATCH
+        longest = len(data) - LAST_LITERALS - position
+        while length < longest and data[candidate + length] == data[position + length]:
+            length += 1
+        write_sequence(out, data[anchor:position], position - candidate, length)
+        for skipped in range(position + 1, min(position + length, len(data) - MATCH_LIMIT)):
+            last_seen[data[skipped:skipped + MIN_MATCH]] = skipped
+        position += length
+        anchor = position
+    write_sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def decompress(block, size):
+    """Decode an LZ4 block the way the firmware does, with the same checks."""
+    out = bytearray()
+    position = 0
+
+    def next_byte():
+        nonlocal position
+        if position >= len(block):
+            raise ValueError("block cut short")
+        position += 1
+        return block[position - 1]
+
+    def extend(length):
+        value = 255 if length == 15 else 0
+        while value == 255:
+            value = next_byte()
+            length += value
+        return length
+
+    while True:
+        token = next_byte()
+        literals = extend(token >> 4)
+        if literals > size - len(out) or literals > len(block) - position:
+            raise ValueError("literals out of range")
+        out += block[position:position + literals]
+        position += literals
+        if position == len(block):
+            if len(out) != size:
+                raise ValueError("decoded %d bytes, expected %d" % (len(out), size))
+            return bytes(out)
+        offset = next_byte() | next_byte() << 8
+        match = extend(token & 0xF) + MIN_MATCH
+        if offset == 0 or offset > len(out) or match > size - len(out):
+            raise ValueError("match out of range")
+        for _ in range(match):
+            out.append(out[-offset])
+
+
+def pack_bin(data):
+    if len(data) > BIN_LIMIT:
+        raise ValueError("larger than the %d bytes the firmware loads" % BIN_LIMIT)
+    block = compress(data)
+    if decompress(block, len(data)) != data:
+        raise ValueError("round trip failed")
+    return BIN_MAGIC + struct.pack("<I", len(data)) + block
+
+
+def pack_chf(data):
+    magic, header_length, _, _, _, _, _ = CHF_HEADER.unpack_from(data, 0)
+    if magic != CHF_MAGIC or header_length > len(data):
+        raise ValueError("not a CHF file")
+    out = bytearray(data[:header_length])
+    position = header_length
+    while position + CHIP_HEADER.size <= len(data):
+        magic, packet_length, chip_type, bank, address, size = CHIP_HEADER.unpack_from(data, position)
+        if magic != CHIP_MAGIC or packet_length < CHIP_HEADER.size or position + packet_length > len(data):
+            break
+        packet = data[position:position + packet_length]
+        payload = packet[CHIP_HEADER.size:CHIP_HEADER.size + size]
+        if chip_type in DATA_CHIP_TYPES and bank == 0 and len(payload) == size:
+            block = compress(payload)
+            if decompress(block, size) != payload:
+                raise ValueError("round trip failed for the packet at 0x%04X" % address)
+            if len(block) < packet_length - CHIP_HEADER.size:
+                packed_length = CHIP_HEADER.size + len(block)
+                packet = CHIP_HEADER.pack(PACKED_CHIP_MAGIC, packed_length, chip_type, bank, address, size) + block
+        out += packet
+        position += packet_length
+    out += data[position:]
+    return bytes(out)
+
+
+def self_test():
+    """Round trip blocks that exercise each part of the format."""
+    generator = random.Random(3850)
+    cases = {
+        "empty": b"",
+        "short": b"F8",
+        "random": bytes(generator.getrandbits(8) for _ in range(5000)),
+        "zeros": bytes(20000),
+        "overlapping run": b"ab" * 3000,
+        "long literals": bytes(generator.getrandbits(8) for _ in range(300)) + bytes(300),
+    }
+    chunk = bytes(generator.getrandbits(8) for _ in range(3000))
+    cases["far match"] = chunk + bytes(generator.getrandbits(8) for _ in range(60000)) + chunk
+    cases["repeated text"] = b"CHANNEL F VIDEOCART " * 400 + cases["random"][:100]
+    for name, data in cases.items():
+        block = compress(data)
+        if decompress(block, len(data)) != data:
+            print("FAIL %s" % name)
+            return False
+        print("ok   %-16s %6d -> %6d bytes" % (name, len(data), len(block)))
+    for corrupt in (b"\xf0", b"\x00\x00", b"\x1f\x41\x05\x00"):
+        try:
+            decompress(corrupt, 16)
+            print("FAIL corrupt block %s was accepted" % corrupt.hex())
+            return False
+        except ValueError:
+            pass
+    print("ok   corrupt blocks rejected")
+    return True
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("rom", nargs="?", help=".bin or .chf file")
+    parser.add_argument("-o", "--output", help="where to write the packed file")
+    parser.add_argument("--self-test", action="store_true", help="round trip test blocks, then exit")
+    args = parser.parse_args()
+
+    if args.self_test:
+        sys.exit(0 if self_test() else 1)
+    if not args.rom or not args.output:
+        parser.error("a ROM and --output are needed")
+    if os.path.abspath(args.rom) == os.path.abspath(args.output):
+        parser.error("the packed file can't replace the original")
+
+    with open(args.rom, "rb") as file:
+        data = file.read()
+    try:
+        packed = pack_chf(data) if data.startswith(CHF_MAGIC) else pack_bin(data)
+    except (ValueError, struct.error) as error:
+        sys.exit("%s: %s" % (args.rom, error))
+    with open(args.output, "wb") as file:
+        file.write(packed)
+    print("%s: %d -> %d bytes (%.0f%%)" % (args.rom, len(data), len(packed), 100 * len(packed) / max(len(data), 1)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""Decode a bus trace recorded by the Videocart firmware (see Firmware/trace.hpp).
+
+Reads a trace file copied from the SD card (/.pvctrace), or raw bytes captured
+from USB serial, and prints one line per recorded bus cycle, followed by a
+summary of the ROMC codes seen and the records dropped.
+
+    python3 trace_decode.py .pvctrace
+    python3 trace_decode.py capture.bin --summary
+"""
+
+import argparse
+import struct
+import sys
+from collections import Counter
+
+MAGIC = b"PVTR"
+BLOCK_HEADER = struct.Struct("<4sHHI")  # magic, count, record_size, dropped
+RECORD = struct.Struct("<HBBHH")        # cycle, romc, dbus, pc0, dc0
+
+ROMC_NAMES = [
+    "FETCH", "BRANCH", "READ DC0", "IMMEDIATE", "PC1->PC0", "WRITE DC0", "DC0 HIGH", "PC1 HIGH",
+    "RESET", "DC0 LOW", "ADD DC0", "PC1 LOW", "PC0 LOW<-MEM", "PC1=PC0+1", "DC0 LOW<-MEM", "INT VECTOR LOW",
+    "FREEZE INT", "DC0 HIGH<-MEM", "PC0->PC1", "INT VECTOR HIGH", "PC0 HIGH<-BUS", "PC1 HIGH<-BUS", "DC0 HIGH<-BUS", "PC0 LOW<-BUS",
+    "PC1 LOW<-BUS", "DC0 LOW<-BUS", "PORT WRITE", "PORT READ", "IDLE", "SWAP DC", "PC0 LOW OUT", "PC0 HIGH OUT",
+]
+
+
+def blocks(data):
+    """Yield (dropped, records) for each block, skipping anything that isn't one."""
+    position = data.find(MAGIC)
+    while position >= 0 and position + BLOCK_HEADER.size <= len(data):
+        _, count, record_size, dropped = BLOCK_HEADER.unpack_from(data, position)
+        start = position + BLOCK_HEADER.size
+        end = start + count * record_size
+        if record_size < RECORD.size or end > len(data):
+            position = data.find(MAGIC, position + 1)  # Not a block, or cut short
+            continue
+        yield dropped, [RECORD.unpack_from(data, start + i * record_size) for i in range(count)]
+        position = data.find(MAGIC, end)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("trace", help="trace file, or a capture of the serial output")
+    parser.add_argument("--summary", action="store_true", help="only print the summary")
+    args = parser.parse_args()
+
+    with open(args.trace, "rb") as file:
+        data = file.read()
+
+    romc_counts = Counter()
+    records = 0
+    dropped = 0
+    gaps = 0
+    last_cycle = None
+    for block_dropped, block in blocks(data):
+        if block_dropped != dropped and not args.summary:
+            print(f"--- {block_dropped - dropped} records dropped ---")
+        dropped = block_dropped
+        for cycle, romc, dbus, pc0, dc0 in block:
+            skipped = 0 if last_cycle is None else (cycle - last_cycle - 1) & 0xFFFF
+            gaps += skipped != 0
+            last_cycle = cycle
+            records += 1
+            romc_counts[romc] += 1
+            if not args.summary:
+                gap = f"  (+{skipped} cycles)" if skipped else ""
+                print(f"{cycle:5d}  {romc:02X} {ROMC_NAMES[romc & 0x1F]:<16} dbus={dbus:02X} pc0={pc0:04X} dc0={dc0:04X}{gap}")
+
+    print(f"{records} records, {dropped} dropped, {gaps} gaps", file=sys.stderr)
+    for romc, count in sorted(romc_counts.items()):
+        print(f"  {romc:02X} {ROMC_NAMES[romc & 0x1F]:<16} {count}", file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()